@@ -1,3 +1,8 @@
+#ifndef API_H
+#define API_H
+
+#include <sys/uio.h>
+
 // These are some general errors
 
 #define ERR_DISK_FULL -1
@@ -14,17 +19,59 @@
 #define LSEEK_ABSOLUTE 1
 #define LSEEK_END 2
 
+#define FS_OPEN_DEFAULT 0
+#define FS_OPEN_MMAP 1
+#define FS_OPEN_URING 2
+#define FS_OPEN_DIRECT 4
+
+#define FORMAT_BITMAP 1
+#define FORMAT_LAZY 2
+#define FORMAT_LARGE 4
+#define FORMAT_EXTENTS 8
+#define FORMAT_INLINE 16
+#define FORMAT_DIR_INDEX 32
+
 // These functions open the real file on disk that contains your filesystem.
 
 // Opens the real "disk" file. Called once before any other functions are called.
 int open_fs(char *fs_path);
 
+// Same as open_fs, mode selects how the "disk" is accessed.
+// FS_OPEN_MMAP maps the whole file and turns block I/O into memory copies,
+// changes are msync'd by close_fs.
+// FS_OPEN_URING sends block I/O through io_uring and submits the block writes of each
+// call together, it silently stays synchronous if io_uring is unavailable.
+// FS_OPEN_DIRECT opens the file with O_DIRECT so blocks are only buffered by our
+// own cache, I/O is then synchronous and sized to the device's logical block size.
+int open_fs_mode(char *fs_path, int mode);
+
 // Closes the "disk" file and synchronizes any unwritten changes.
-void close_fs();
+// Any files and directories still open are closed. Returns SUCCESS, or an error if
+// some of the changes could not be written.
+int close_fs();
+
+// Writes the superblock and every cached block back to the "disk" file.
+int fs_sync(void);
 
 // Formats the "disk" file with a new file system structure.
 int format_fs(char *fs_path, int num_blocks);
 
+// Same as format_fs with on-disk format options.
+// block_size is a power of two from 512 to 65536 bytes, format_fs uses 512. open_fs
+// picks the block size up from the disk.
+// FORMAT_BITMAP tracks free data blocks in a bitmap instead of a linked list.
+// FORMAT_LAZY only writes the metadata in use, unused inodes and data blocks are
+// set up the first time they are allocated.
+// FORMAT_LARGE allows disks over 2 GB and adds a triple indirection block to each
+// inode (in place of the last direct block) so files can grow to 2^31 blocks.
+// FORMAT_EXTENTS maps file blocks as runs of consecutive disk blocks (extents) kept in
+// a small tree rooted in the inode, instead of one pointer per block.
+// FORMAT_INLINE stores files of up to 44 bytes in their inode, without a data block.
+// FORMAT_DIR_INDEX hashes the entries of directories larger than one block, so finding
+// a name reads one bucket (plus the index and one block of its slot table) however big
+// the directory gets, and a full bucket splits without touching the others.
+int format_fs_opts(char *fs_path, int num_blocks, int block_size, int flags);
+
 // Opens a file and creates an entry in an "open files" table.
 // Returns an int that is in index into this table.
 int file_open(char *path);
@@ -35,7 +82,8 @@ int file_create(char *path);
 
 // Closes a file. Removes the index int the "open files" table and ensures
 // that all data is synchronized with the disk.
-void file_close(int file_number);
+// Returns SUCCESS, or an error if the file was not open or its buffered writes could not be written.
+int file_close(int file_number);
 
 // Reads a specified number of bytes from file into buffer.
 // Returns the number of bytes actually read.
@@ -52,10 +100,34 @@ int file_write(int file_number, void *buffer, int bytes);
 // Returns the new offset or an error.
 int file_lseek(int file_number, int offset, int command);
 
+// Same as file_lseek with 64 bit offsets, for files past 2 GB.
+long long file_lseek64(int file_number, long long offset, int command);
+
+// Read and write like file_read and file_write, but at offset instead of the seek position,
+// which they leave alone. A write past the end of the file grows it.
+// These two may be called from several threads at once, on the same file or not.
+// Writes take turns. Reads only hold the lock to map blocks and copy the cached ones,
+// so their disk reads overlap, and a read racing a write of the same bytes may see
+// part of it.
+int file_pread(int file_number, void *buffer, int bytes, long long offset);
+int file_pwrite(int file_number, void *buffer, int bytes, long long offset);
+
+// Scatter/gather versions of file_read and file_write. The iovcnt buffers are read or
+// written in order from the seek position, as if they were one buffer.
+// Returns the total number of bytes moved.
+int file_readv(int file_number, const struct iovec *iov, int iovcnt);
+int file_writev(int file_number, const struct iovec *iov, int iovcnt);
+
 // Deletes the specified file.
 // Returns an error or SUCCESS.
 int file_delete(char *path);
 
+// Creates a file for each of the count names in the directory dir_path, writing each
+// inode block and directory block touched once instead of once per file.
+// Returns how many were created (names[0] up to the first one that could not be,
+// because it exists, is not a valid name or the disk is full) or an error.
+int file_create_batch(char *dir_path, char **names, int count);
+
 // Creates the specified directory.
 // Returns an error or SUCCESS.
 int file_mkdir(char *path);
@@ -70,3 +142,34 @@ char **file_listdir(char *path);
 
 // Prints a directory listing to the screen.
 void file_printdir(char *path);
+
+// One directory entry as returned by file_readdir.
+struct fs_dirent
+{
+    char name[12];
+    int inode_number;
+    int is_dir;
+};
+
+// Opens a directory for reading its entries one at a time.
+// Returns an index into the "open directories" table or an error.
+int file_opendir(char *path);
+
+// Fills in entry with the next entry of the directory, nothing is allocated.
+// Returns 1, 0 once there are no entries left, or an error.
+int file_readdir(int dir_number, struct fs_dirent *entry);
+
+// Closes a directory opened with file_opendir.
+void file_closedir(int dir_number);
+
+// Same as the functions without _at, but a path not starting with / is looked up
+// from the directory open as dir_number (see file_opendir) instead of the root.
+int file_open_at(int dir_number, char *path);
+int file_create_at(int dir_number, char *path);
+int file_mkdir_at(int dir_number, char *path);
+int file_delete_at(int dir_number, char *path);
+int file_rmdir_at(int dir_number, char *path);
+char **file_listdir_at(int dir_number, char *path);
+int file_opendir_at(int dir_number, char *path);
+
+#endif
@@ -70,5 +70,10 @@ int main(int argc, const char **argv)
     }
 
     close_fs();
+
+    test_formats();
+    test_modes();
+    test_dirs();
+    test_vectored();
 }
 
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // O_DIRECT
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -5,6 +7,16 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+
+// linux/fs.h (pulled in by io_uring.h) has its own BLOCK_SIZE
+#undef BLOCK_SIZE
 
 #include "api.h"
 #include "filesystem.h"
@@ -12,1091 +24,4444 @@
 #define DEBUG1 0
 #define DEBUG2 0
 
-int write_block(int file, const void *buf, int block_num)
+// Block size of the disk, chosen by format_fs_opts and read back from the superblock by open_fs.
+int fs_block_size = MIN_BLOCK_SIZE;
+
+// Block cache state. The cache sits underneath read_block/write_block and is
+// only active between open_fs and close_fs, format_fs always goes to disk.
+int cache_size = CACHE_SIZE;
+int cache_hand;
+int *cache_hash;
+struct cache_entry *cache = NULL;
+
+// Bytes of small writes each open file gathers before writing them out, rounded up to
+// whole blocks when a handle first buffers (0 disables the write buffers).
+int write_buffer_size = WRITE_BUFFER_SIZE;
+
+// Serializes file_pread/file_pwrite, the only calls that may come from several threads at once.
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// In-memory copy of the superblock (block 1), loaded by open_fs. Allocation and
+// free paths update it here and it is written back by sync_superblock.
+struct superblock *fs_sb = NULL;
+int sb_dirty = 0;
+
+// Allocation layout, set up by open_fs. With FORMAT_BITMAP, fs_bitmap holds the
+// whole free block bitmap in memory (bit i is disk block data_start + i) and
+// bitmap_dirty has a flag per bitmap block that needs writing back.
+int fs_features = 0;
+int data_start;
+unsigned long *fs_bitmap = NULL;
+int bitmap_words;
+int bitmap_hint;
+BYTE *bitmap_dirty;
+
+// Inode cache state, keyed by inode number. Entries are allocated one by one so the
+// pointers get_inode hands out stay put when the slot table grows. Held entries
+// (refcount > 0) are never evicted, open files hold theirs until file_close.
+struct inode_cache_entry **icache = NULL;
+int icache_slots;
+int icache_used;
+int icache_hand;
+int icache_hash[INODE_CACHE_SIZE];
+
+// Dentry cache, a direct mapped table of path component lookups. A slot is simply
+// overwritten by the next lookup hashing to it.
+struct dentry_cache_entry dcache[DENTRY_CACHE_SIZE];
+
+// Directories being read by file_readdir.
+struct open_dir_table_entry open_dir_table[MAX_OPEN_DIRS];
+
+// Mapping of the whole disk file when opened with FS_OPEN_MMAP, NULL otherwise.
+// While mapped, every block access is a memcpy and the block cache is not used.
+BYTE *fs_map = NULL;
+off_t fs_map_size;
+
+// O_DIRECT state, dio_size is 0 unless opened with FS_OPEN_DIRECT. Transfers are
+// then whole multiples of dio_size at aligned offsets from aligned memory, anything
+// else is bounced through buffers kept in dio_pool.
+int dio_size = 0;
+BYTE *dio_pool[DIO_POOL_SIZE];
+int dio_pool_count = 0;
+
+void *alloc_block_buffer(size_t size)
 {
-    lseek(file, (block_num*BLOCK_SIZE), SEEK_SET);
-    return (write(file, buf, BLOCK_SIZE));
+    void *buf;
+    size_t align = dio_size > 0 ? dio_size : sizeof(void *);
+
+    if(posix_memalign(&buf, align, size))
+        return NULL;
+
+    return buf;
 }
 
-int read_block(int file, void *buf, int block_num)
+BYTE *dio_buf_get(void)
 {
-    lseek(file, (block_num*BLOCK_SIZE), SEEK_SET);
-    return (read(file, buf, BLOCK_SIZE));
+    if(dio_pool_count > 0)
+        return dio_pool[--dio_pool_count];
+
+    return alloc_block_buffer(DIO_BUF_SIZE);
 }
 
-int open_fs(char *fs_path)
+void dio_buf_put(BYTE *buf)
 {
-    struct superblock *sb = malloc(sizeof(struct superblock));
+    if(dio_pool_count < DIO_POOL_SIZE)
+        dio_pool[dio_pool_count++] = buf;
+    else
+        free(buf);
+}
 
-    file = open(fs_path, O_RDWR);
+//the superblock is block 1, so it sits one block size into the file. Returns that size
+int probe_block_size(int file)
+{
+    struct superblock *sb = alloc_block_buffer(MIN_BLOCK_SIZE);
+    int size, r;
 
-    if( !read_block(file, sb, 1) )
-    {
-        return ERR_FILE_NOT_FOUND;
-    }
-    if(sb->fs_type != 12345)
+    for(size = MIN_BLOCK_SIZE; size <= MAX_BLOCK_SIZE; size *= 2)
     {
-        return ERR_INVALID_DISK_FILE;
+        if(dio_size > 0)
+            r = direct_pread(file, sb, MIN_BLOCK_SIZE, size);
+        else
+            r = pread(file, sb, MIN_BLOCK_SIZE, size);
+
+        if(r != MIN_BLOCK_SIZE || sb->fs_type != 12345)
+            continue;
+
+        //images from before the extension fields are always 512 byte blocks
+        if(sb->ext_magic == SB_EXT_MAGIC ? sb->block_size == size : size == MIN_BLOCK_SIZE)
+            break;
     }
-    NUM_BLOCKS = sb->disk_size / BLOCK_SIZE;
-    NUM_INODE_BLOCKS = NUM_BLOCKS / 32;
-    NUM_INODES_PER_BLOCK = 8;
-    NUM_INODES = NUM_INODE_BLOCKS * NUM_INODES_PER_BLOCK;
-    NUM_DATA_BLOCKS = NUM_BLOCKS - 2 - NUM_INODE_BLOCKS;
 
     free(sb);
-    return SUCCESS;
+    return size <= MAX_BLOCK_SIZE ? size : -1;
 }
 
-void close_fs()
+//smallest transfer size O_DIRECT accepts on this file
+int dio_probe_size(int file)
 {
-    close(file);
-}
+    struct stat st;
+    unsigned int sector;
+    int size, max;
+    void *buf;
 
-int format_fs(char *fs_path, int num_blocks)
-{
-    int i;
+    if(ioctl(file, BLKSSZGET, &sector) == 0)
+        return sector;
 
-    NUM_BLOCKS = num_blocks;
-    NUM_INODE_BLOCKS = NUM_BLOCKS / 32;
-    NUM_INODES_PER_BLOCK = 8;
-    NUM_INODES = NUM_INODE_BLOCKS * NUM_INODES_PER_BLOCK;
-    NUM_DATA_BLOCKS = NUM_BLOCKS - 2 - NUM_INODE_BLOCKS;
+    if(fstat(file, &st) < 0)
+        return -1;
 
-    struct bootblock *bootblock = malloc(sizeof(struct bootblock));
-    struct superblock *superblock = malloc(sizeof(struct superblock));
-    struct inode_block *inode_block = malloc(sizeof(struct inode_block));
-    struct inode *inode = malloc(sizeof(struct inode));
-    struct free_data_block *free_data_block = malloc(sizeof(struct free_data_block));
-    struct directory *root_dir = malloc(sizeof(struct directory));
+    max = st.st_blksize > MIN_BLOCK_SIZE ? st.st_blksize : MIN_BLOCK_SIZE;
 
-    if (NUM_BLOCKS < 32)
+    if(posix_memalign(&buf, max, max))
+        return -1;
+
+    for(size = MIN_BLOCK_SIZE; size <= max; size *= 2)
     {
-        DEBUG2 && printf("Unable to create file system. Minimum blocks must be >= 32\n");
-        return ERR_MIN_BLOCKS;
+        if(pread(file, buf, size, 0) == size)
+            break;
     }
 
-    file = open(fs_path, O_RDWR|O_CREAT, 00777);
+    free(buf);
+    return size <= max ? size : -1;
+}
 
-    // Writing the bootblock to file
-    write_block(file, bootblock, 0);
+int dio_aligned(const void *buf, int len, off_t off)
+{
+    return ((unsigned long)buf % dio_size) == 0 && (len % dio_size) == 0 && (off % dio_size) == 0;
+}
 
-    // Writing the superblock to file
-    superblock->fs_type = 12345;
-    superblock->disk_size = NUM_BLOCKS * BLOCK_SIZE;
-    superblock->blocks_allocated = 0;
-    superblock->max_blocks = NUM_DATA_BLOCKS;
-    superblock->files_allocated = 1;
-    superblock->max_files = NUM_INODES;
-    superblock->free_inode_list = 1;
-    superblock->free_data_block_list = NUM_INODE_BLOCKS + 3;
-    write_block(file, superblock, 1);
+int direct_pread(int file, void *buf, int len, off_t off)
+{
+    BYTE *bbuf = (BYTE *)buf;
+    BYTE *bounce;
+    off_t start;
+    int head, chunk, span, r;
+    int done = 0;
 
-    // Writing the inode block to file
-    int j;
-    int count = 0;
+    if(dio_aligned(buf, len, off))
+        return pread(file, buf, len, off);
+
+    bounce = dio_buf_get();
 
-    for (j = 0; j < NUM_INODE_BLOCKS; j++)
+    while(done < len)
     {
-        for(i = 0; i < NUM_INODES_PER_BLOCK; i++)
+        start = (off + done) - ((off + done) % dio_size);
+        head = (off + done) - start;
+        chunk = DIO_BUF_SIZE - head;
+        if(chunk > len - done)
+            chunk = len - done;
+        span = ((head + chunk + dio_size - 1) / dio_size) * dio_size;
+
+        r = pread(file, bounce, span, start);
+        if(r < head + chunk)
         {
-            if(j == 0 && i == 0)
+            //end of file, hand back what we got
+            if(r > head)
             {
-                // This is the root
-                inode_block->inodes[i].is_dir = 1;
-                inode_block->inodes[i].num_blocks = 1;
-                //we shouldn't maintain pointers to next free inode on used inodes
-                inode_block->inodes[i].next_free_inode = -2;  //j + 1;
-                inode_block->inodes[i].is_free = 0;
-                inode_block->inodes[i].file_blocks[0] = NUM_INODE_BLOCKS + 2;
-                continue;
+                memcpy(bbuf + done, bounce + head, r - head);
+                done += r - head;
             }
+            break;
+        }
 
-            inode_block->inodes[i].is_dir = 0;
-            inode_block->inodes[i].is_free = 1;
-            inode_block->inodes[i].num_blocks = 0;
-            //we dont want to point to zero since thats a valid block
-            inode_block->inodes[i].file_blocks[0] = -3;
-            //last free inode points to null
+        memcpy(bbuf + done, bounce + head, chunk);
+        done += chunk;
+    }
 
-            if(i == NUM_INODES_PER_BLOCK-1 && j == NUM_INODE_BLOCKS-1)
-                inode_block->inodes[i].next_free_inode = -1;
+    dio_buf_put(bounce);
+    return done;
+}
 
-            else
-                inode_block->inodes[i].next_free_inode = j*NUM_INODES_PER_BLOCK + i + 1;
-        }
+int direct_pwrite(int file, const void *buf, int len, off_t off)
+{
+    const BYTE *bbuf = (const BYTE *)buf;
+    BYTE *bounce;
+    off_t start;
+    int head, chunk, span, r;
+    int done = 0;
 
-        write_block(file, inode_block, 2 + j);
-    }
+    if(dio_aligned(buf, len, off))
+        return pwrite(file, buf, len, off);
+
+    bounce = dio_buf_get();
 
-    // Writing the free data blocks to file
-    for(i = 0; i < NUM_DATA_BLOCKS; i++)
+    while(done < len)
     {
-        if(i == NUM_DATA_BLOCKS - 1)
-            free_data_block->next_free_block = -1;
+        start = (off + done) - ((off + done) % dio_size);
+        head = (off + done) - start;
+        chunk = DIO_BUF_SIZE - head;
+        if(chunk > len - done)
+            chunk = len - done;
+        span = ((head + chunk + dio_size - 1) / dio_size) * dio_size;
+
+        //partial sectors at either end keep their old contents
+        if(head != 0 || chunk != span)
+        {
+            r = pread(file, bounce, span, start);
+            if(r < 0)
+                break;
+            if(r < span)
+                memset(bounce + r, 0, span - r);
+        }
 
-        else
-            free_data_block->next_free_block = NUM_INODE_BLOCKS + 2 + i + 1;
+        memcpy(bounce + head, bbuf + done, chunk);
 
-        write_block(file, free_data_block, NUM_INODE_BLOCKS + 2 + i);
-    }
+        if(pwrite(file, bounce, span, start) != span)
+            break;
 
-    free(superblock);
-    free(inode_block);
-    free(inode);
-    free(free_data_block);
-    free(root_dir);
+        done += chunk;
+    }
 
-    close(file);
-    return SUCCESS;
+    dio_buf_put(bounce);
+    return done;
 }
 
-
-struct inode_block *get_inode_block(int inode_num)
+int direct_preadv(int file, const struct iovec *iov, int iovcnt, off_t off)
 {
-    struct inode_block *inode_blk;
-    int inode_block_num  = (inode_num / 8) + 2;
-    int s;
+    int i, r;
+    int done = 0;
 
-    if(inode_num < 0 || inode_num >= NUM_INODES)
-    {
-        DEBUG1 && printf("get_inode_block: inode_num out of range\n");
-        DEBUG1 && printf("get_inode_block: inode_num = %d \n", inode_num);
-        DEBUG1 && printf("get_inode_block: NUM_INODES = %d \n", NUM_INODES);
-        return NULL;
-    }
+    for(i = 0; i < iovcnt && dio_aligned(iov[i].iov_base, iov[i].iov_len, off); i++);
 
-    inode_blk = malloc(sizeof(struct inode_block));
+    if(i == iovcnt)
+        return preadv(file, iov, iovcnt, off);
 
-    if( !(read_block(file, inode_blk, inode_block_num)) )
+    for(i = 0; i < iovcnt; i++)
     {
-        DEBUG2 && printf("get_inode_block: failed to read inode block\n");
-        free(inode_blk);
-        inode_blk = NULL;
+        r = direct_pread(file, iov[i].iov_base, iov[i].iov_len, off + done);
+        if(r < 0)
+            return r;
+        done += r;
+        if(r < (int)iov[i].iov_len)
+            break;
     }
 
-    return inode_blk;
+    return done;
 }
 
-int put_inode_block(struct inode_block *ib, int inode_num)
+int direct_pwritev(int file, const struct iovec *iov, int iovcnt, off_t off)
 {
-    int inode_block_num = (inode_num / 8) + 2;
+    int i, r;
+    int done = 0;
 
-    DEBUG1 && printf("inode_block_num = %d \n", inode_block_num);
+    for(i = 0; i < iovcnt && dio_aligned(iov[i].iov_base, iov[i].iov_len, off); i++);
 
-    if( !(write_block(file, ib, inode_block_num)) )
+    if(i == iovcnt)
+        return pwritev(file, iov, iovcnt, off);
+
+    for(i = 0; i < iovcnt; i++)
     {
-        //free(inode_blk);
-        //inode_blk = NULL;
-        return -1;
+        r = direct_pwrite(file, iov[i].iov_base, iov[i].iov_len, off + done);
+        if(r < 0)
+            return r;
+        done += r;
+        if(r < (int)iov[i].iov_len)
+            break;
     }
 
-    return 0;
+    return done;
 }
 
-//pass 2 pointers by ref. and inode number, returns 0 on success, updates pointers by ref.
-int get_inode(struct inode_block **inode_block, struct inode **inode, int inode_num)
+void dio_destroy(void)
 {
-    int offset = inode_num % 8;
-
-    if(inode_num < 0)
-        return -1;
-
-    *inode_block = get_inode_block(inode_num);
-
-    if(!inode_block)
+    while(dio_pool_count > 0)
     {
-        return -1;
+        free(dio_pool[--dio_pool_count]);
     }
 
-    *inode = &(**inode_block).inodes[offset];
-
-    return 0;
+    dio_size = 0;
 }
 
+// io_uring backend state, ring.fd is -1 unless opened with FS_OPEN_URING and the
+// kernel supports it. Inside an API call (io_batch_begin/io_batch_end, which nest)
+// single block writes are staged and go out together in one submission when it returns.
+struct uring ring = { -1 };
+int io_batching = 0;
 
-
-//find free inode, remove from free inode list, return inode number
-int get_free_inode(void)
+int uring_init(void)
 {
-    struct superblock *sb = malloc(sizeof(struct superblock));
-    struct inode_block *iblock;
-    struct inode *inode;
-
-    int inode_num;
-    int new_free;
+    struct io_uring_params p;
     int i;
 
-    if(! read_block(file, sb, 1))
+    memset(&p, 0, sizeof(p));
+
+    ring.fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if(ring.fd < 0)
     {
-        DEBUG2 && printf("Error reading superblock\n");
+        DEBUG2 && printf("uring_init: io_uring unavailable, using synchronous I/O\n");
+        ring.fd = -1;
         return -1;
     }
 
-    if( (inode_num = sb->free_inode_list) == -1)
+    ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                        ring.fd, IORING_OFF_SQ_RING);
+    ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                        ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+
+    if(ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED || ring.sqes == MAP_FAILED)
     {
-        DEBUG2 && printf("Error no free inodes\n");
+        DEBUG2 && printf("uring_init: mapping rings failed, using synchronous I/O\n");
+        close(ring.fd);
+        ring.fd = -1;
         return -1;
     }
 
-    if(get_inode(&iblock, &inode, inode_num))
+    ring.sq_head = (unsigned *)((BYTE *)ring.sq_ring + p.sq_off.head);
+    ring.sq_tail = (unsigned *)((BYTE *)ring.sq_ring + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)((BYTE *)ring.sq_ring + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)((BYTE *)ring.sq_ring + p.sq_off.array);
+    ring.cq_head = (unsigned *)((BYTE *)ring.cq_ring + p.cq_off.head);
+    ring.cq_tail = (unsigned *)((BYTE *)ring.cq_ring + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)((BYTE *)ring.cq_ring + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)((BYTE *)ring.cq_ring + p.cq_off.cqes);
+    ring.entries = p.sq_entries;
+    ring.queued = 0;
+    ring.failed = 0;
+
+    ring.stage = malloc(URING_DEPTH * BLOCK_SIZE);
+    ring.num_staged = 0;
+
+    if(ring.stage == NULL)
     {
-        DEBUG2 && 	printf("ERROR: couldn't get inode \n ");
+        DEBUG2 && printf("uring_init: no memory for the stage, using synchronous I/O\n");
+        munmap(ring.sqes, ring.sqes_size);
+        munmap(ring.cq_ring, ring.cq_ring_size);
+        munmap(ring.sq_ring, ring.sq_ring_size);
+        close(ring.fd);
+        ring.fd = -1;
         return -1;
     }
-
-    new_free = inode->next_free_inode;
-
-    inode->next_free_inode = -2;
-    inode->is_free=0;
-    inode->num_blocks=0;
-    inode->is_dir=0;
-
-    for(i=0; i < 10 ; i++)
+    for(i = 0; i < URING_DEPTH; i++)
     {
-        inode->file_blocks[i] = 0;
+        ring.stage_iov[i].iov_base = ring.stage + i*BLOCK_SIZE;
+        ring.stage_iov[i].iov_len = BLOCK_SIZE;
     }
 
-    inode->indirect1 = 0;
-    inode->indirect2 = 0;
-
-
-    DEBUG1 && printf("new_free: %d \n", new_free);
+    return 0;
+}
 
-    sb->free_inode_list = new_free;
-    sb->files_allocated++;
+//waits for every queued request, returns -1 if any of them failed
+int uring_submit_wait(void)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    int ret = 0;
 
-    if(! write_block(file, sb, 1))
+    while(ring.queued > 0)
     {
-        DEBUG2 && printf("Error writing superblock\n");
-        return -1;
-    }
+        //only the first call actually has new entries to hand over
+        if(syscall(__NR_io_uring_enter, ring.fd, ring.queued, ring.queued, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+        {
+            DEBUG2 && printf("uring_submit_wait: io_uring_enter failed\n");
+            ring.queued = 0;
+            return -1;
+        }
 
-    if(put_inode_block(iblock, inode_num))
-    {
-        return -1;
+        head = *ring.cq_head;
+        while(head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+        {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            if(cqe->res < 0 || cqe->res != (int)cqe->user_data)
+            {
+                DEBUG2 && printf("uring_submit_wait: request failed (%d)\n", cqe->res);
+                ring.failed = 1;
+            }
+            head++;
+            ring.queued--;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
     }
 
-    free(sb);
-    free(iblock);
+    if(ring.failed)
+        ret = -1;
 
-    return inode_num;
+    ring.failed = 0;
+    return ret;
 }
 
-int get_free_datablock(void)
+//queues one readv/writev of len bytes at block_num, submitting first if the ring is full
+void uring_queue(int op, const struct iovec *iov, int iovcnt, int block_num, int len)
 {
-    struct superblock *sb = malloc(sizeof(struct superblock));
-    struct free_data_block *fdb = malloc(sizeof(struct free_data_block));
-    struct datablock *empty_db = malloc(sizeof(struct datablock));
-    int free_db_num, i;
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
 
-    for(i=0; i < 512; i++)
+    if(ring.queued >= (int)ring.entries)
     {
-        empty_db->byte[i] = 0;
+        if(uring_submit_wait())
+            ring.failed = 1;
     }
 
-    if(!read_block(file, sb, 1))
-    {
-        DEBUG2 && printf("Error reading superblock\n");
-        return -1;
-    }
+    tail = *ring.sq_tail;
+    idx = tail & *ring.sq_mask;
+    sqe = &ring.sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = file;
+    sqe->addr = (unsigned long)iov;
+    sqe->len = iovcnt;
+    sqe->off = (off_t)block_num*BLOCK_SIZE;
+    sqe->user_data = len; //completions are checked against the expected length
+
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.queued++;
+}
 
-    free_db_num = sb->free_data_block_list;
+//submits every staged block write as one batch, they stay staged (and are tried again
+//by the next flush) unless all of them completed
+int uring_flush_stage(void)
+{
+    int i;
 
-    if(free_db_num < 0)
-    {
-        free(sb);
-        free(fdb);
-        DEBUG1 && printf("no free data blocks \n");
-        return -1;
-    }
+    if(ring.num_staged == 0)
+        return 0;
 
-    if(!read_block(file, fdb, free_db_num))
+    for(i = 0; i < ring.num_staged; i++)
     {
-        DEBUG2 && printf("Error reading superblock\n");
-        return -1;
+        uring_queue(IORING_OP_WRITEV, &ring.stage_iov[i], 1, ring.stage_block[i], BLOCK_SIZE);
     }
 
-    sb->free_data_block_list = fdb->next_free_block;
-
-    if(!write_block(file, sb, 1))
+    if(uring_submit_wait())
     {
-        DEBUG2 && printf("Error writing superblock\n");
+        DEBUG2 && printf("uring_flush_stage: write back failed, %d blocks kept\n", ring.num_staged);
         return -1;
     }
 
-    fdb->next_free_block = -1;
+    ring.num_staged = 0;
+    return 0;
+}
 
-    if(!write_block(file, empty_db, free_db_num))
+int uring_find_staged(int block_num)
+{
+    int i;
+
+    for(i = 0; i < ring.num_staged; i++)
     {
-        DEBUG2 && printf("Error writing new datablock\n");
-        return -1;
+        if(ring.stage_block[i] == block_num)
+            return i;
     }
 
-    return free_db_num;
+    return -1;
 }
 
-int add_data_block(int inode_num)
+int uring_destroy(void)
 {
-    struct datablock *dblock = malloc(sizeof(struct datablock));
-    struct indirection_block *iblock1;
-    struct indirection_block *iblock2;
-    struct inode_block *iblock;
-    struct inode  *inode;
+    int ret = SUCCESS;
 
-    int block_num;
-    int new_db_num = get_free_datablock();
-    DEBUG1 && printf("new db number: %d \n", new_db_num);
+    if(ring.fd < 0)
+        return SUCCESS;
 
-    if(new_db_num < 0)
-        return -1;
+    if(uring_flush_stage())
+        ret = ERR_INTERNAL;
 
+    munmap(ring.sqes, ring.sqes_size);
+    munmap(ring.cq_ring, ring.cq_ring_size);
+    munmap(ring.sq_ring, ring.sq_ring_size);
+    close(ring.fd);
+    free(ring.stage);
+    ring.fd = -1;
+    ring.num_staged = 0;
+    io_batching = 0;
 
-    get_inode(&iblock, &inode, inode_num);
+    return ret;
+}
 
-    block_num = inode->num_blocks;
+void io_batch_begin(void)
+{
+    io_batching++;
+}
 
-    if(!inode)
-    {
-        DEBUG2 && printf("inode is null\n");
-        return -1;
-    }
+int io_batch_end(int ret)
+{
+    //only the outermost call submits
+    if(--io_batching > 0 || ring.fd < 0)
+        return ret;
+
+    if(uring_flush_stage())
+        return ret < 0 ? ret : ERR_INTERNAL;
+
+    return ret;
+}
 
-    if(block_num >= 0 && block_num < 10)
+int disk_write_block(int file, const void *buf, int block_num)
+{
+    int i;
+
+    if(ring.fd >= 0)
     {
-        inode->file_blocks[block_num] = new_db_num;
-        inode->num_blocks++;
+        struct iovec iov;
 
-        if(put_inode_block(iblock, inode_num))
+        //outside an API call there is nothing to batch with, staged blocks still go first
+        if(!io_batching)
         {
-            return -1;
+            if(uring_flush_stage())
+                return -1;
+
+            iov.iov_base = (void *)buf;
+            iov.iov_len = BLOCK_SIZE;
+            uring_queue(IORING_OP_WRITEV, &iov, 1, block_num, BLOCK_SIZE);
+            return uring_submit_wait() ? -1 : BLOCK_SIZE;
         }
 
-        free(iblock);
+        //a later write of the same block simply replaces the staged copy
+        if((i = uring_find_staged(block_num)) == -1)
+        {
+            if(ring.num_staged == URING_DEPTH && uring_flush_stage())
+                return -1;
+
+            i = ring.num_staged++;
+            ring.stage_block[i] = block_num;
+        }
 
-        return new_db_num;
+        memcpy(ring.stage + i*BLOCK_SIZE, buf, BLOCK_SIZE);
+        return BLOCK_SIZE;
     }
 
-    else if(block_num == 10)
-    {
-        //make indirection block
-        struct indirection_block *ib = malloc(sizeof(struct indirection_block));
+    if(dio_size > 0)
+        return direct_pwrite(file, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
 
-        ib->pointer[0] = new_db_num;
+    return (pwrite(file, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE));
+}
 
-        int ind_block_num = get_free_datablock();
-        if(ind_block_num < 0)
-            return -1;
-        DEBUG1 && printf("adding indirection block: %d\n", ind_block_num);
+int disk_read_block(int file, void *buf, int block_num)
+{
+    struct iovec iov;
+    int i;
 
-        if(!write_block(file, ib, ind_block_num))
+    if(ring.fd >= 0)
+    {
+        if((i = uring_find_staged(block_num)) != -1)
         {
-            DEBUG2 && printf("Error writing indirection block\n");
-            return -1;
+            memcpy(buf, ring.stage + i*BLOCK_SIZE, BLOCK_SIZE);
+            return BLOCK_SIZE;
         }
 
-        inode->indirect1 = ind_block_num;
-        inode->num_blocks++;
+        iov.iov_base = buf;
+        iov.iov_len = BLOCK_SIZE;
+        uring_queue(IORING_OP_READV, &iov, 1, block_num, BLOCK_SIZE);
 
-        if(put_inode_block(iblock, inode_num))
-        {
-            return -1;
-        }
+        //failed like a pread would have
+        return uring_submit_wait() ? -1 : BLOCK_SIZE;
+    }
 
-        free(ib);
-        free(iblock);
+    if(dio_size > 0)
+        return direct_pread(file, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
 
-        return new_db_num;
-    }
+    return (pread(file, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE));
+}
 
-    else if(block_num > 10 && block_num < (10+128))
+int iov_bytes(const struct iovec *iov, int iovcnt)
+{
+    int i;
+    int len = 0;
+
+    for(i = 0; i < iovcnt; i++)
     {
-        struct indirection_block *ib = malloc(sizeof(struct indirection_block));
+        len += iov[i].iov_len;
+    }
 
-        int ind_block_num = inode->indirect1;
-
-        if(!read_block(file, ib, ind_block_num))
-        {
-            DEBUG2 && printf("Error reading indirection block\n");
-            return -1;
-        }
+    return len;
+}
 
-        ib->pointer[block_num - 10] = new_db_num;
+int disk_writev_blocks(int file, const struct iovec *iov, int iovcnt, int block_num)
+{
+    int len;
 
-        if(! write_block(file, ib, ind_block_num))
-        {
-            DEBUG2 && printf("Error writing indirection block\n");
+    if(ring.fd >= 0)
+    {
+        //staged blocks are older than this write, they must land first
+        if(ring.num_staged > 0 && uring_flush_stage())
             return -1;
-        }
 
-        inode->num_blocks++;
+        len = iov_bytes(iov, iovcnt);
+        uring_queue(IORING_OP_WRITEV, iov, iovcnt, block_num, len);
+        return uring_submit_wait() ? -1 : len;
+    }
 
-        if(put_inode_block(iblock, inode_num))
-        {
-            return -1;
-        }
+    if(dio_size > 0)
+        return direct_pwritev(file, iov, iovcnt, (off_t)block_num*BLOCK_SIZE);
 
-        free(ib);
-        free(iblock);
+    return (pwritev(file, iov, iovcnt, (off_t)block_num*BLOCK_SIZE));
+}
 
-        return new_db_num;
-    }
+int disk_readv_blocks(int file, const struct iovec *iov, int iovcnt, int block_num)
+{
+    int len;
 
-    else if(block_num == (10+128))
+    if(ring.fd >= 0)
     {
-        struct indirection_block *ib1 = malloc(sizeof(struct indirection_block));
-        struct indirection_block *ib2 = malloc(sizeof(struct indirection_block));
+        if(ring.num_staged > 0 && uring_flush_stage())
+            return -1;
 
-        int ind_block_num1 = get_free_datablock();
-        int ind_block_num2 = get_free_datablock();
+        len = iov_bytes(iov, iovcnt);
+        uring_queue(IORING_OP_READV, iov, iovcnt, block_num, len);
+        return uring_submit_wait() ? -1 : len;
+    }
 
-        if(ind_block_num1 < 0 || ind_block_num2 < 0)
-            return -1;
+    if(dio_size > 0)
+        return direct_preadv(file, iov, iovcnt, (off_t)block_num*BLOCK_SIZE);
 
-        inode->indirect2 = ind_block_num1;
-        inode->num_blocks++;
+    return (preadv(file, iov, iovcnt, (off_t)block_num*BLOCK_SIZE));
+}
 
-        ib1->pointer[0] = ind_block_num2;
-        ib2->pointer[0] = new_db_num;
+void set_cache_size(int num_blocks)
+{
+    if(num_blocks < 0)
+        num_blocks = 0;
 
-        if(!write_block(file, ib1, ind_block_num1))
-        {
-            DEBUG2 && printf("Error writing indirection block\n");
-            return -1;
-        }
+    cache_size = num_blocks;
+}
 
-        if(!write_block(file, ib2, ind_block_num2))
-        {
-            DEBUG2 && printf("Error writing indirection block\n");
-            return -1;
-        }
+int cache_init(void)
+{
+    int i;
 
-        if(put_inode_block(iblock, inode_num))
-        {
-            return -1;
-        }
+    if(cache_size <= 0)
+    {
+        cache = NULL;
+        return SUCCESS;
+    }
 
-        free(ib1);
-        free(ib2);
-        free(iblock);
+    cache = malloc(sizeof(struct cache_entry) * cache_size);
+    cache_hash = malloc(sizeof(int) * cache_size);
 
-        return new_db_num;
+    if(cache == NULL || cache_hash == NULL)
+    {
+        DEBUG2 && printf("cache_init: out of memory\n");
+        free(cache);
+        free(cache_hash);
+        cache = NULL;
+        return ERR_INTERNAL;
     }
 
-    else if(block_num > (10+128) && block_num < (10+128+(128*128)))
+    for(i = 0; i < cache_size; i++)
     {
-        struct indirection_block *ib1 = malloc(sizeof(struct indirection_block));
-        struct indirection_block *ib2 = malloc(sizeof(struct indirection_block));
+        cache[i].block_num = -1;
+        cache[i].dirty = 0;
+        cache[i].referenced = 0;
+        cache[i].next = -1;
+        //aligned so O_DIRECT write-back can go straight from the slots
+        cache[i].data = alloc_block_buffer(BLOCK_SIZE);
+        cache_hash[i] = -1;
+
+        if(cache[i].data == NULL)
+        {
+            DEBUG2 && printf("cache_init: out of memory\n");
 
-        int ind_block_num1 = inode->indirect2;
+            while(i > 0)
+            {
+                free(cache[--i].data);
+            }
 
-        if( !read_block(file, ib1, ind_block_num1))
-        {
-            DEBUG2 && printf("error reading datablock\n");
-            return -1;
+            free(cache);
+            free(cache_hash);
+            cache = NULL;
+            return ERR_INTERNAL;
         }
+    }
 
-        if(((block_num - (10+128)) % 128) == 0)
-        {
-            int new_ind_block = get_free_datablock();
-            ib1->pointer[(block_num - (10+128)) / 128] = new_ind_block;
-            ib2->pointer[0] = new_db_num;
-            inode->num_blocks++;
+    cache_hand = 0;
+    return SUCCESS;
+}
 
-            if(!write_block(file, ib1, ind_block_num1))
-            {
-                DEBUG2 && printf("error reading datablock\n");
-                return -1;
-            }
+int cache_lookup(int block_num)
+{
+    int slot = cache_hash[block_num % cache_size];
 
-            if(!write_block(file, ib2, new_ind_block))
-            {
-                DEBUG2 && printf("error reading datablock\n");
-                return -1;
-            }
-            if(put_inode_block(iblock, inode_num))
-            {
-                return -1;
-            }
+    while(slot != -1 && cache[slot].block_num != block_num)
+    {
+        slot = cache[slot].next;
+    }
 
-            return new_db_num;
-        }
+    return slot;
+}
 
-        else
-        {
-            int ind_block_num2 = ib1->pointer[(block_num - (10+128)) / 128];
+//unlinks a slot from its hash chain
+void cache_unhash(int slot)
+{
+    int *link = &cache_hash[cache[slot].block_num % cache_size];
 
-            if(!read_block(file, ib2, ind_block_num2))
-            {
-                DEBUG2 && printf("error reading datablock\n");
-                return -1;
-            }
+    while(*link != slot)
+    {
+        link = &cache[*link].next;
+    }
 
-            ib2->pointer[(block_num - (10+128)) % 128] = new_db_num;
+    *link = cache[slot].next;
+    cache[slot].next = -1;
+    cache[slot].block_num = -1;
+}
 
-            inode->num_blocks++;
+//CLOCK eviction, returns a clean unhashed slot ready to be filled, or -1 if two full
+//sweeps (one to clear the referenced bits, one to evict) found no slot that could be written back
+int cache_evict(void)
+{
+    int slot, tries;
 
-            if( !write_block(file, ib2, ind_block_num2))
-            {
-                DEBUG2 && printf("error reading datablock\n");
-                return -1;
-            }
+    for(tries = 0; tries < 2*cache_size; tries++)
+    {
+        slot = cache_hand;
+        cache_hand = (cache_hand + 1) % cache_size;
+
+        if(cache[slot].block_num == -1)
+            return slot;
 
-            if(put_inode_block(iblock, inode_num))
+        if(cache[slot].referenced)
+        {
+            cache[slot].referenced = 0;
+            continue;
+        }
+
+        if(cache[slot].dirty)
+        {
+            if(disk_write_block(file, cache[slot].data, cache[slot].block_num) != BLOCK_SIZE)
             {
-                return -1;
+                DEBUG2 && printf("cache_evict: error writing back block %d\n", cache[slot].block_num);
+                continue;
             }
-
-            return new_db_num;
+            cache[slot].dirty = 0;
         }
-    }
 
-    else
-    {
-        DEBUG2 && printf("Error: cannot add another block, filesize max reached\n");
-        return -1;
+        cache_unhash(slot);
+        return slot;
     }
 
-    return new_db_num;
+    DEBUG2 && printf("cache_evict: no slot could be written back\n");
+    return -1;
 }
 
-int add_dir_to_inode(int inode_num, char *n_dir, int n_inode_num)
+//links an unhashed slot into the hash table as block_num
+void cache_link(int slot, int block_num)
 {
-    struct inode_block *ib = malloc(sizeof(struct inode_block));
-    struct inode *inode = NULL;
-    struct directory *nd = malloc(sizeof(struct directory));
-    struct directory *cur_dir = NULL;
-    struct datablock *datablock = NULL;
+    int bucket = block_num % cache_size;
 
+    cache[slot].block_num = block_num;
+    cache[slot].referenced = 1;
+    cache[slot].dirty = 0;
+    cache[slot].next = cache_hash[bucket];
+    cache_hash[bucket] = slot;
+}
 
-    int data_block_num;
-    int i;
-    int new_dir_block_num;
-    for(i=0 ; i < 32 ; i++)
-    {
-        strcpy(nd->entries[i].filename,"");
-        nd->entries[i].inode_number = 0;
-    }
+int cache_slot_cmp(const void *a, const void *b)
+{
+    return cache[*(const int *)a].block_num - cache[*(const int *)b].block_num;
+}
 
-    get_inode(&ib, &inode, inode_num);
+int cache_flush(void)
+{
+    struct iovec *iov;
+    int *dirty;
+    int num_dirty = 0;
+    int i, j, run;
+    int ret = SUCCESS;
 
-    if(inode->num_blocks == 0)
+    if(cache == NULL)
+        return SUCCESS;
+
+    dirty = malloc(sizeof(int) * cache_size);
+    iov = malloc(sizeof(struct iovec) * cache_size);
+
+    for(i = 0; i < cache_size; i++)
     {
-        new_dir_block_num = add_data_block(inode_num);
+        if(cache[i].block_num != -1 && cache[i].dirty)
+            dirty[num_dirty++] = i;
+    }
 
-        if(new_dir_block_num < 0)
-        {
-            return ERR_DISK_FULL;
-        }
+    //write back in block order so physically adjacent blocks go out in one pwritev
+    qsort(dirty, num_dirty, sizeof(int), cache_slot_cmp);
 
-        strcpy(nd->entries[0].filename, n_dir);
-        nd->entries[0].inode_number = n_inode_num;
+    //with io_uring every run is queued and the whole flush is one submission, after the
+    //staged writes since those may hold older copies of the same blocks
+    if(ring.fd >= 0 && uring_flush_stage())
+        ret = ERR_INTERNAL;
 
-        if(!write_block(file, nd, new_dir_block_num))
+    for(i = 0; i < num_dirty; i += run)
+    {
+        run = 0;
+        while(i + run < num_dirty && run < MAX_IOV_BLOCKS &&
+                cache[dirty[i + run]].block_num == cache[dirty[i]].block_num + run)
         {
-            DEBUG2 && printf("error reading datablock\n");
-            return ERR_INTERNAL;
+            iov[i + run].iov_base = cache[dirty[i + run]].data;
+            iov[i + run].iov_len = BLOCK_SIZE;
+            run++;
         }
-        return SUCCESS;
-    }
-
-    if(inode->num_blocks > 0)
-    {
-        //int dir_block_num = inode->num_blocks - 1;
-        data_block_num = get_data_block(&datablock, inode, inode->num_blocks - 1);
-        cur_dir = (struct directory *)datablock;
 
-        for(i=0; i < 32 ; i++)
+        if(ring.fd >= 0)
         {
-            if(cur_dir->entries[i].inode_number <= 0)
-            {
-                cur_dir->entries[i].inode_number = n_inode_num;
-                strcpy(cur_dir->entries[i].filename, n_dir);
-
-                if( !write_block(file, cur_dir, data_block_num))
-                {
-                    DEBUG2 && printf("error reading datablock\n");
-                    return ERR_INTERNAL;
-                }
-                return SUCCESS;
-            }
+            uring_queue(IORING_OP_WRITEV, &iov[i], run, cache[dirty[i]].block_num, run*BLOCK_SIZE);
         }
-        //we got here, we need another data block
-        new_dir_block_num = add_data_block(inode_num);
-        if(new_dir_block_num < 0)
+        else if(disk_writev_blocks(file, &iov[i], run, cache[dirty[i]].block_num) != run*BLOCK_SIZE)
         {
-            DEBUG2 && printf("error no more free data blocks\n");
-            return ERR_DISK_FULL;
+            DEBUG2 && printf("cache_flush: error writing blocks %d-%d\n",
+                             cache[dirty[i]].block_num, cache[dirty[i]].block_num + run - 1);
+            ret = ERR_INTERNAL;
+            continue;
         }
-        strcpy(nd->entries[0].filename, n_dir);
-        nd->entries[0].inode_number = n_inode_num;
 
-        if(!write_block(file, nd, new_dir_block_num))
+        for(j = 0; j < run; j++)
         {
-            DEBUG2 && printf("error writing datablock\n");
-            return ERR_INTERNAL;
+            cache[dirty[i + j]].dirty = 0;
         }
-        return SUCCESS;
+    }
 
+    if(ring.fd >= 0 && uring_submit_wait())
+    {
+        //we can't tell which run failed, keep all of them dirty
+        for(i = 0; i < num_dirty; i++)
+        {
+            cache[dirty[i]].dirty = 1;
+        }
+        ret = ERR_INTERNAL;
     }
 
-    return SUCCESS;
+    free(iov);
+    free(dirty);
+    return ret;
 }
 
-int get_data_block(struct datablock **dblk, struct inode *inode, int file_block_num)
+int cache_destroy(void)
 {
-    struct datablock *dblock = malloc(sizeof(struct datablock));
-    struct indirection_block *iblock1;
-    struct indirection_block *iblock2;
+    int i, ret;
 
-    int block_num;
+    if(cache == NULL)
+        return SUCCESS;
 
-    if(!inode)
+    ret = cache_flush();
+
+    for(i = 0; i < cache_size; i++)
     {
-        DEBUG2 && printf("inode is null\n");
-        dblock = NULL;
-        return -1;
+        free(cache[i].data);
     }
 
-    if(file_block_num >= 0 && file_block_num < 10)
+    free(cache);
+    free(cache_hash);
+    cache = NULL;
+
+    return ret;
+}
+
+void *map_block(int block_num)
+{
+    if(fs_map == NULL || block_num < 0 || (off_t)(block_num + 1)*BLOCK_SIZE > fs_map_size)
+        return NULL;
+
+    return fs_map + (off_t)block_num*BLOCK_SIZE;
+}
+
+int write_block(int file, const void *buf, int block_num)
+{
+    int slot;
+    void *mapped;
+
+    if(fs_map != NULL)
     {
-        block_num = inode->file_blocks[file_block_num];
+        if((mapped = map_block(block_num)) == NULL)
+            return 0;
 
-        if(!read_block(file, dblock, block_num))
-        {
-            DEBUG2 && printf("error reading datablock\n");
-            dblock = NULL;
-            return -1;
-        }
+        memcpy(mapped, buf, BLOCK_SIZE);
+        return BLOCK_SIZE;
     }
 
-    else if(file_block_num >= 10 && file_block_num < (10+128))
+    if(cache == NULL || block_num < 0)
+        return disk_write_block(file, buf, block_num);
+
+    //whole block writes never need the old contents, so a miss just takes a slot
+    if((slot = cache_lookup(block_num)) == -1)
     {
-        iblock1 = malloc(sizeof(struct indirection_block));
-        block_num = inode->indirect1;
+        if((slot = cache_evict()) == -1)
+            return 0;
 
-        if(!read_block(file, iblock1, block_num))
-        {
-            DEBUG2 && printf("error reading datablock\n");
-            //return NULL;
-            dblock = NULL;
-            return -1;
+        cache_link(slot, block_num);
+    }
 
-        }
+    memcpy(cache[slot].data, buf, BLOCK_SIZE);
+    cache[slot].dirty = 1;
+    cache[slot].referenced = 1;
 
-        block_num = iblock1->pointer[file_block_num - 10];
+    return BLOCK_SIZE;
+}
 
-        if(!read_block(file, dblock, block_num))
-        {
-            DEBUG2 && printf("error reading datablock\n");
-            //return NULL;
-            dblock = NULL;
-            return -1;
-        }
+int read_block(int file, void *buf, int block_num)
+{
+    int slot;
+    int ret;
+    void *mapped;
+
+    if(fs_map != NULL)
+    {
+        if((mapped = map_block(block_num)) == NULL)
+            return 0;
 
-        free(iblock1);
+        memcpy(buf, mapped, BLOCK_SIZE);
+        return BLOCK_SIZE;
     }
 
-    else if(file_block_num >= (10+128) && file_block_num < (10+128+(128*128)))
-    {
-        iblock1 = malloc(sizeof(struct indirection_block));
-        iblock2 = malloc(sizeof(struct indirection_block));
+    if(cache == NULL || block_num < 0)
+        return disk_read_block(file, buf, block_num);
 
-        block_num = inode->indirect2;
+    if((slot = cache_lookup(block_num)) == -1)
+    {
+        if((slot = cache_evict()) == -1)
+            return 0;
 
-        if(!read_block(file, iblock1, block_num))
+        if((ret = disk_read_block(file, cache[slot].data, block_num)) != BLOCK_SIZE)
         {
-            DEBUG2 && printf("error reading datablock\n");
-            //return NULL;
-            dblock = NULL;
-            return -1;
+            //leave the slot empty, short reads are reported like before
+            return ret;
         }
 
-        block_num = iblock1->pointer[(file_block_num - (10+128)) / 128 ];
+        cache_link(slot, block_num);
+    }
 
-        if( !read_block(file, iblock2, block_num))
-        {
-            DEBUG2 && printf("error reading datablock\n");
-            //return NULL;
-            dblock = NULL;
-            return -1;
-        }
+    cache[slot].referenced = 1;
+    memcpy(buf, cache[slot].data, BLOCK_SIZE);
 
-        block_num = iblock2->pointer[(file_block_num - (10+128)) % 128];
+    return BLOCK_SIZE;
+}
 
-        if( !read_block(file, dblock, block_num))
-        {
-            DEBUG2 && printf("error reading datablock\n");
-            //return NULL;
-            dblock = NULL;
-            return -1;
+void *block_data(int block_num, int dirty)
+{
+    int slot;
 
-        }
+    if(fs_map != NULL)
+        return map_block(block_num);
 
-        free(iblock1);
-        free(iblock2);
-    }
+    if(cache == NULL || block_num < 0)
+        return NULL;
 
-    else
+    if((slot = cache_lookup(block_num)) == -1)
     {
-        DEBUG2 && printf("Error: block number out of range\n");
-        // return NULL;
-        dblock = NULL;
-        return -1;
+        if((slot = cache_evict()) == -1 || disk_read_block(file, cache[slot].data, block_num) != BLOCK_SIZE)
+            return NULL;
+
+        cache_link(slot, block_num);
     }
 
-    *dblk = dblock;
+    cache[slot].referenced = 1;
 
-    return block_num;
+    if(dirty)
+        cache[slot].dirty = 1;
+
+    return cache[slot].data;
 }
 
-int has_file(struct inode *cur_inode, char *cur)
+int copy_block_part(int block_num, int offset, void *buf, int len, int to_block)
 {
-    //this assumes cur_inode is dir and looks for something named cur
-    int i,k;
-
-    struct directory *cur_directory_block = NULL;// = malloc(sizeof(struct directory));
-    struct datablock *datablock = NULL;
+    BYTE *data;
+    int ret = len;
 
-    if(cur_inode == NULL)
+    //copy in place when the block is mapped or cached, staging it only without either
+    if((data = block_data(block_num, to_block)) != NULL)
     {
-        DEBUG1 && printf("cur_inode is null \n");
-        return -1;
+        if(to_block)
+            memcpy(data + offset, buf, len);
+        else
+            memcpy(buf, data + offset, len);
+
+        return len;
     }
 
-    if(cur_inode->is_dir == 0)
+    data = malloc(BLOCK_SIZE);
+
+    if(!read_block(file, data, block_num))
     {
-        return -2; //cur_inode not dir
+        ret = -1;
     }
+    else if(to_block)
+    {
+        memcpy(data + offset, buf, len);
 
-    for(i=0 ; i < cur_inode->num_blocks; i++)
+        if(!write_block(file, data, block_num))
+            ret = -1;
+    }
+    else
     {
-        get_data_block(&datablock, cur_inode, i);
-        cur_directory_block = (struct directory *)datablock;
+        memcpy(buf, data + offset, len);
+    }
 
-        if( ! (cur_directory_block) )
-        {
-            DEBUG2 && printf("error reading dir block\n");
-            return -2;
-        }
+    free(data);
 
-        for(k=0 ; k < 32 ; k++)
-        {
-            int cur_inum = cur_directory_block->entries[k].inode_number;
-            char *cur_iname = cur_directory_block->entries[k].filename;
+    return ret;
+}
 
-            //printf("has_file: cur_inum %d\n",cur_inum);
-            //printf("has_file: cur_iname %s %d\n", cur_iname, strlen(cur_iname));
-            //printf("has_file: cur %s %d\n", cur, strlen(cur));
-            if(cur_inum < 0)
-            {
-                return -2;//invalid inode
-            }
-
-            if(strcmp(cur, cur_iname) == 0)
-            {
-                //printf("has_file: match\n");
-                return cur_inum;
-            }
-
-        }
-    }
-
-    return -1; //not found
-}
-
-int hack_funct()
+void cache_prefetch(int block_num, int count)
 {
-    struct inode_block *ib = NULL;
-    struct inode *inode = NULL;
-    struct directory *new_d = malloc(sizeof(struct directory));
+    struct iovec iov[MAX_IOV_BLOCKS];
+    int slots[MAX_IOV_BLOCKS];
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned long start;
+    int i = 0, n, k;
+
+    //a mapped disk only needs the kernel to start paging the range in
+    if(fs_map != NULL)
+    {
+        if(map_block(block_num) == NULL || map_block(block_num + count - 1) == NULL)
+            return;
 
-    int i, j;
+        start = (unsigned long)map_block(block_num) & ~(page - 1);
+        madvise((void *)start, (unsigned long)map_block(block_num) - start + count*BLOCK_SIZE, MADV_WILLNEED);
+        return;
+    }
 
-    get_inode(&ib, &inode, 1);
+    if(cache == NULL)
+        return;
 
-    inode->next_free_inode = -1;
-    inode->is_free = 0;
-    inode->is_dir = 1;
-    inode->num_blocks = 1;
-    inode->file_blocks[0] = 4;
+    //small enough that the clock hand cannot come round to the slots taken here twice
+    if(count > cache_size / 4)
+        count = cache_size / 4;
 
-    write_block(file, ib, 2);
-    free(ib);
+    if(count > MAX_IOV_BLOCKS)
+        count = MAX_IOV_BLOCKS;
 
-    for (i=0; i<32; i++)
+    while(i < count)
     {
-        for (j=0; j<12; j++)
+        if(cache_lookup(block_num + i) != -1)
         {
-            new_d->entries[i].filename[j] = 0;
+            i++;
+            continue;
         }
 
-        new_d->entries[i].inode_number = 0;
-    }
+        //each stretch of uncached blocks goes straight into slots with a single read, the
+        //slots are linked as they are taken so the eviction of the next one passes over them
+        for(n = 0; i + n < count && cache_lookup(block_num + i + n) == -1; n++)
+        {
+            if((slots[n] = cache_evict()) == -1)
+                break;
 
+            cache_link(slots[n], block_num + i + n);
+            iov[n].iov_base = cache[slots[n]].data;
+            iov[n].iov_len = BLOCK_SIZE;
+        }
 
-    new_d->entries[0].filename[0] = 'c';
-    new_d->entries[0].filename[1] = 'w';
-    new_d->entries[0].filename[2] = 'i';
-    new_d->entries[0].filename[3] = 'l';
-    new_d->entries[0].filename[4] = 'l';
-    new_d->entries[0].filename[5] = 's';
-    new_d->entries[0].filename[6] = '\0';
+        //it's only a hint, give up once slots can't be had
+        if(n == 0)
+            return;
 
-    new_d->entries[0].inode_number = 2;
+        if(disk_readv_blocks(file, iov, n, block_num + i) != n*BLOCK_SIZE)
+        {
+            DEBUG2 && printf("cache_prefetch: short read at block %d\n", block_num + i);
 
-    write_block(file, new_d, 4);
+            for(k = 0; k < n; k++)
+            {
+                cache_unhash(slots[k]);
+            }
+            return;
+        }
 
-    free(new_d);
-    //printf("endofhack\n");
+        i += n;
+    }
 }
 
-int create_file(char *path, int is_dir)
+int read_blocks(int file, void *buf, int block_num, int count)
 {
-    char *lpath = malloc(sizeof(char)*strlen(path)+1);
-    char *last;
-    char *ptr;
-    int wd, free_inode_num, found, s;
+    BYTE *bbuf = (BYTE *)buf;
+    struct iovec iov;
+    int i = 0;
+    int run_start, len, slot;
 
-    struct inode_block *cur_inode_block = NULL;
-    struct inode *cur_inode = NULL;
+    if(fs_map != NULL)
+    {
+        if(map_block(block_num) == NULL || map_block(block_num + count - 1) == NULL)
+            return 0;
 
-    strcpy(lpath, path);
+        memcpy(buf, map_block(block_num), count*BLOCK_SIZE);
+        return count*BLOCK_SIZE;
+    }
 
-    if(strlen(lpath) == 1)
+    while(i < count)
     {
-        if(lpath[0] == '/')
+        if(cache != NULL && (slot = cache_lookup(block_num + i)) != -1)
         {
-            return ERR_FILE_EXISTS;
+            cache[slot].referenced = 1;
+            memcpy(bbuf + i*BLOCK_SIZE, cache[slot].data, BLOCK_SIZE);
+            i++;
+            continue;
         }
-        else
+
+        //everything up to the next cached block is read in a single call
+        run_start = i;
+        while(i < count && (cache == NULL || cache_lookup(block_num + i) == -1))
+        {
+            i++;
+        }
+
+        len = (i - run_start) * BLOCK_SIZE;
+        iov.iov_base = bbuf + run_start*BLOCK_SIZE;
+        iov.iov_len = len;
+        if(disk_readv_blocks(file, &iov, 1, block_num + run_start) != len)
         {
-            return ERR_INVALID_PATH;
+            DEBUG2 && printf("read_blocks: short read at block %d\n", block_num + run_start);
+            return run_start*BLOCK_SIZE;
         }
     }
 
-    ptr = strrchr(lpath, '/');
+    return count*BLOCK_SIZE;
+}
 
+int read_blocks_unlocked(int file, void *buf, int block_num, int count)
+{
+    BYTE *bounce;
+    off_t off = (off_t)block_num*BLOCK_SIZE;
+    off_t start;
+    int len = count*BLOCK_SIZE;
+    int head, span, r;
 
-    if(ptr == lpath+strlen(lpath)-1)
+    if(fs_map != NULL)
     {
-        *ptr = '\0';
-        ptr = strrchr(lpath, '/');
+        if(map_block(block_num) == NULL || map_block(block_num + count - 1) == NULL)
+            return 0;
+
+        memcpy(buf, map_block(block_num), len);
+        return len;
     }
 
-    *ptr = '\0';
-    ptr++;
+    if(dio_size == 0 || dio_aligned(buf, len, off))
+        return pread(file, buf, len, off);
 
-    last = malloc(sizeof(char)*strlen(ptr)+1);
+    //the shared bounce buffers are for callers holding the lock, this one gets its own
+    start = off - off % dio_size;
+    head = off - start;
+    span = ((head + len + dio_size - 1) / dio_size) * dio_size;
 
-    strcpy(last, ptr);
+    if((bounce = alloc_block_buffer(span)) == NULL)
+        return 0;
 
-    wd = path_to_inode(lpath);
+    r = pread(file, bounce, span, start) - head;
 
-    DEBUG1 &&  printf("wd = %d \n", wd);
+    if(r > len)
+        r = len;
+    if(r > 0)
+        memcpy(buf, bounce + head, r);
 
-    if(wd < 0)
-    {
-        return ERR_INVALID_PATH;
-    }
-    //printf("wd inode = %d \n", wd);
+    free(bounce);
+    return r < 0 ? 0 : r;
+}
 
-    get_inode(&cur_inode_block, &cur_inode, wd);
+int write_blocks(int file, const void *buf, int block_num, int count)
+{
+    const BYTE *bbuf = (const BYTE *)buf;
+    struct iovec iov;
+    int i = 0;
+    int run_start, len, slot;
 
-    if(cur_inode_block == NULL || cur_inode == NULL)
+    if(fs_map != NULL)
     {
-        DEBUG2 && 	printf("get inode failed\n");
-        return ERR_INTERNAL;
-    }
+        if(map_block(block_num) == NULL || map_block(block_num + count - 1) == NULL)
+            return 0;
 
-    found = has_file(cur_inode, last);
-    //printf("found = %d \n", found);
-    DEBUG1 && printf("found = %d \n", found);
+        memcpy(map_block(block_num), buf, count*BLOCK_SIZE);
+        return count*BLOCK_SIZE;
+    }
 
-    if(found != -1)
+    while(i < count)
     {
-        //printf("file or dir already exists!\n");
-        //printf("wd = %d, last = %s \n ", wd, last);
-        return ERR_FILE_EXISTS;
-    }
+        //keep cached copies current instead of dropping them
+        if(cache != NULL && (slot = cache_lookup(block_num + i)) != -1)
+        {
+            memcpy(cache[slot].data, bbuf + i*BLOCK_SIZE, BLOCK_SIZE);
+            cache[slot].dirty = 1;
+            cache[slot].referenced = 1;
+            i++;
+            continue;
+        }
 
-    free_inode_num = get_free_inode();
-    //printf("free inode num = %d\n", free_inode_num);
+        run_start = i;
+        while(i < count && (cache == NULL || cache_lookup(block_num + i) == -1))
+        {
+            i++;
+        }
 
-    if(free_inode_num < 0)
-    {
-        return ERR_MAX_FILES;
+        len = (i - run_start) * BLOCK_SIZE;
+        iov.iov_base = (void *)(bbuf + run_start*BLOCK_SIZE);
+        iov.iov_len = len;
+        if(disk_writev_blocks(file, &iov, 1, block_num + run_start) != len)
+        {
+            DEBUG2 && printf("write_blocks: short write at block %d\n", block_num + run_start);
+            return run_start*BLOCK_SIZE;
+        }
     }
 
-    get_inode( &cur_inode_block, &cur_inode , free_inode_num);
+    return count*BLOCK_SIZE;
+}
+
+int bitmap_next_zero(int from)
+{
+    int w = from / BITS_PER_WORD;
+    int bit;
+    unsigned long word;
+
+    if(from < 0 || from >= NUM_DATA_BLOCKS)
+        return -1;
 
-    if(cur_inode_block == NULL || cur_inode == NULL)
+    //skip whole words that are fully allocated
+    word = ~fs_bitmap[w] & (~0UL << (from % BITS_PER_WORD));
+    while(word == 0)
     {
-        return ERR_INTERNAL;
+        if(++w >= bitmap_words)
+            return -1;
+        word = ~fs_bitmap[w];
     }
 
-    cur_inode->is_dir = is_dir;
+    bit = w*BITS_PER_WORD + __builtin_ctzl(word);
+    return bit < NUM_DATA_BLOCKS ? bit : -1;
+}
 
-    put_inode_block(cur_inode_block, free_inode_num);
+int bitmap_next_one(int from)
+{
+    int w = from / BITS_PER_WORD;
+    int bit;
+    unsigned long word;
 
-    //free_data_block_num = get_free_datablock();
-    //printf("free_data_block_num = %d\n", free_data_block_num);
+    if(from >= NUM_DATA_BLOCKS)
+        return NUM_DATA_BLOCKS;
 
-    s = add_dir_to_inode(wd, last, free_inode_num);
+    word = fs_bitmap[w] & (~0UL << (from % BITS_PER_WORD));
+    while(word == 0)
+    {
+        if(++w >= bitmap_words)
+            return NUM_DATA_BLOCKS;
+        word = fs_bitmap[w];
+    }
 
-    return s;
+    bit = w*BITS_PER_WORD + __builtin_ctzl(word);
+    return bit < NUM_DATA_BLOCKS ? bit : NUM_DATA_BLOCKS;
 }
 
-int path_to_inode(char *orig_path)
+int bitmap_find_run(int want, int *len)
 {
-    char *cur;
-    struct inode_block *cur_inode_block = NULL;
-    struct inode *cur_inode = NULL;
-    char *path;
-    path = malloc(sizeof(char)*strlen(orig_path));
-    strcpy(path, orig_path);
-
-    pwd = 0; //start at root
+    int start, end, from, pass;
+    int best = -1;
+    int best_len = 0;
 
-    //printf("path = %s\n");
-    //if(strcmp(path, "/") == 0)
-    //return 0;
-
-    for(cur = strtok(path, "/"); cur != NULL; cur = strtok(NULL, "/"))
+    //next fit from the last allocation, then once more from the start
+    for(pass = 0; pass < 2; pass++)
     {
-        int prev_wd = pwd;
-
-        DEBUG1 && printf("%s \n",cur);
+        from = pass == 0 ? bitmap_hint : 0;
 
-        if(get_inode(&cur_inode_block, &cur_inode, pwd))
+        while((start = bitmap_next_zero(from)) != -1)
         {
-            DEBUG2 && printf("ERROR: couldn't get free inode \n ");
-            return -1;
-        }
+            if(pass == 1 && start >= bitmap_hint)
+                break;
 
-        pwd = has_file(cur_inode, cur);
+            end = bitmap_next_one(start);
 
-        DEBUG1 && printf("pwd = %d\n", pwd);
+            if(end - start >= want)
+            {
+                *len = want;
+                return start;
+            }
 
-        if(pwd == -1)
-        {
-            DEBUG2 && printf("not found or not valid inode\n");
-            //pwd = prev_wd;
-            pwd = -1;
-            break;
-        }
+            if(end - start > best_len)
+            {
+                best = start;
+                best_len = end - start;
+            }
 
-        if(pwd == -2)
-        {
-            DEBUG1 && printf("not a dir\n");
-            //pwd = prev_wd;
-            pwd = -1;
-            break;
+            from = end;
         }
-
     }
-    free(path);
-    return pwd;
+
+    *len = best_len;
+    return best;
 }
 
-int file_open(char *pathOf)
+void bitmap_mark(int start, int len, int used)
 {
-    struct inode_block *inode_block = NULL;
-    struct inode *inode = NULL;
-    int i;
-    int inum = path_to_inode(pathOf);
-    get_inode(&inode_block, &inode, inum);
+    int bit = start;
+    int end = start + len;
+    int n;
+    unsigned long mask;
 
-    // Check if the file exists. If not then error out
-    if (inum == -1)
+    while(bit < end)
     {
-        DEBUG2 && printf("File not found\n");
-        return ERR_FILE_NOT_FOUND;
-    }
+        n = BITS_PER_WORD - bit % BITS_PER_WORD;
+        if(n > end - bit)
+            n = end - bit;
 
-    get_inode(&inode_block, &inode, inum);
+        if(n == BITS_PER_WORD)
+            mask = ~0UL;
+        else
+            mask = ((1UL << n) - 1) << (bit % BITS_PER_WORD);
 
-    if (inode->is_dir == 1)
-    {
-        DEBUG2 && printf("The file is a directory\n");
-        return ERR_FILE_NOT_FOUND;
+        if(used)
+            fs_bitmap[bit / BITS_PER_WORD] |= mask;
+        else
+            fs_bitmap[bit / BITS_PER_WORD] &= ~mask;
+
+        //a word never straddles two bitmap blocks
+        bitmap_dirty[bit / BITS_PER_BLOCK] = 1;
+        bit += n;
     }
+}
 
-    DEBUG1 && printf("File does exist, is not a directory and is in inode number %d\n", inum);
+int bitmap_load(void)
+{
+    int i;
 
-    //allowing multiple opens of the same file so we need not check if a file is already opened
-    //we just add whatever file we get whether its been opened alread or not
-    /*
-    for (i = 0; i < 20; i++) {
-    	if (open_file_table[i].currently_opened == 1 && open_file_table[i].inode_number == inum){
-    		printf("File already opened\n");
-    		return ERR_FILE_ALREADY_OPEN;
-    	}
+    //a bitmap that doesn't fit the disk means a damaged superblock
+    if(fs_sb->bitmap_blocks <= 0 || fs_sb->bitmap_start < 2 ||
+       (long long)fs_sb->bitmap_start + fs_sb->bitmap_blocks > NUM_BLOCKS)
+    {
+        DEBUG2 && printf("Bitmap blocks %d at %d don't fit the disk\n", fs_sb->bitmap_blocks, fs_sb->bitmap_start);
+        return ERR_INVALID_DISK_FILE;
     }
-    */
 
-    DEBUG1 && printf("Adding to open file table\n");
+    bitmap_words = fs_sb->bitmap_blocks * (BLOCK_SIZE / sizeof(unsigned long));
+    fs_bitmap = malloc((size_t)fs_sb->bitmap_blocks * BLOCK_SIZE);
+    bitmap_dirty = calloc(fs_sb->bitmap_blocks, 1);
+    bitmap_hint = 0;
 
-    // If file exists and is not open, then add an entry to the open file table
+    if(fs_bitmap == NULL || bitmap_dirty == NULL)
+    {
+        bitmap_destroy();
+        return ERR_INTERNAL;
+    }
 
-    for (i = 0; i < 20; i++)
+    for(i = 0; i < fs_sb->bitmap_blocks; i++)
     {
-        if (open_file_table[i].currently_opened == 0)
+        if(!read_block(file, (BYTE *)fs_bitmap + i*BLOCK_SIZE, fs_sb->bitmap_start + i))
         {
-            open_file_table[i].inode_number = inum;
-            open_file_table[i].currently_opened = 1;
-            open_file_table[i].seek_position = 0;
-            DEBUG1 && printf("File added to open file table\n");
-            return i; //this is the index in the table were we put inode
+            DEBUG2 && printf("Error reading bitmap block %d\n", i);
+            bitmap_destroy();
+            return ERR_INTERNAL;
         }
     }
 
-    DEBUG1 && printf("Maximum files opened. Cannot open file\n");
-    return ERR_TOO_MANY_FILES_OPEN;
+    return SUCCESS;
 }
 
-void file_close(int file_number)
+void bitmap_destroy(void)
 {
+    free(fs_bitmap);
+    free(bitmap_dirty);
+    fs_bitmap = NULL;
+    bitmap_dirty = NULL;
+}
 
-    //all we have to do is remove it from the table if its there
-    if(open_file_table[file_number].currently_opened == 0)
+int sync_superblock(void)
+{
+    int i;
+
+    if(fs_sb == NULL || !sb_dirty)
+        return SUCCESS;
+
+    //the bitmap only changes together with the superblock counters
+    for(i = 0; fs_bitmap != NULL && i < fs_sb->bitmap_blocks; i++)
     {
-        DEBUG1 && printf("file with descriptor %d is not currently open. \n", file_number);
-        return;
+        if(bitmap_dirty[i])
+        {
+            if(!write_block(file, (BYTE *)fs_bitmap + i*BLOCK_SIZE, fs_sb->bitmap_start + i))
+            {
+                DEBUG2 && printf("Error writing bitmap block %d\n", i);
+                return ERR_INTERNAL;
+            }
+            bitmap_dirty[i] = 0;
+        }
     }
-    else
+
+    if(!write_block(file, fs_sb, 1))
     {
-        open_file_table[file_number].currently_opened = 0;
-        return;
+        DEBUG2 && printf("Error writing superblock\n");
+        return ERR_INTERNAL;
     }
 
+    sb_dirty = 0;
+    return SUCCESS;
+}
 
-    /*
-    struct inode_block *inode_block = NULL;
-    struct inode *inode = NULL;
-    int inum = path_to_inode(pathOf);
+void superblock_changed(void)
+{
+    //the in-memory copy is authoritative, the disk only needs to catch up now and then
+    if(++sb_dirty >= SUPERBLOCK_SYNC_INTERVAL)
+        sync_superblock();
+}
 
-    get_inode(&inode_block, &inode, inum);
+int fs_sync(void)
+{
+    int ret = SUCCESS;
 
-    // Check if the file exists. If not then error out
-    if (inum == -1)
-    {
-    	printf("File not found\n");
-    	return ERR_FILE_NOT_FOUND;
-    }
+    //buffered writes first, they still have to reach the block cache
+    if(wb_flush_all())
+        ret = ERR_INTERNAL;
 
-    if (inode->is_dir == 1)
-    {
-    	printf("The file is a directory\n");
-    	return -2;
-    }
+    if(sync_superblock() != SUCCESS)
+        ret = ERR_INTERNAL;
 
-    printf("File does exist, is not a directory and is in inode number %d\n", inum);
+    if(inode_cache_flush() != SUCCESS)
+        ret = ERR_INTERNAL;
 
-    int i;
+    if(cache_flush() != SUCCESS)
+        ret = ERR_INTERNAL;
 
-    // Check if file is already opened. If yes the close it
-    for (i = 0; i < 20; i++)
+    if(ring.fd >= 0 && uring_flush_stage())
+        ret = ERR_INTERNAL;
+
+    if(fs_map != NULL && msync(fs_map, fs_map_size, MS_SYNC))
+        ret = ERR_INTERNAL;
+
+    return ret;
+}
+
+int open_fs(char *fs_path)
+{
+    return open_fs_mode(fs_path, FS_OPEN_DEFAULT);
+}
+
+void open_fs_abort(struct superblock *sb)
+{
+    bitmap_destroy();
+    free(sb);
+    fs_sb = NULL;
+
+    if(fs_map != NULL)
+    {
+        munmap(fs_map, fs_map_size);
+        fs_map = NULL;
+    }
+
+    uring_destroy();
+    dio_destroy();
+    close(file);
+}
+
+int open_fs_mode(char *fs_path, int mode)
+{
+    struct superblock *sb;
+    struct stat st;
+    int flags = O_RDWR;
+
+    //a mapping goes through the page cache anyway
+    if((mode & FS_OPEN_DIRECT) && !(mode & FS_OPEN_MMAP))
+        flags |= O_DIRECT;
+
+    file = open(fs_path, flags);
+
+    if(file < 0)
+    {
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    if(flags & O_DIRECT)
+    {
+        dio_size = dio_probe_size(file);
+
+        if(dio_size <= 0 || dio_size > DIO_BUF_SIZE)
+        {
+            DEBUG2 && printf("open_fs: no usable O_DIRECT transfer size\n");
+            dio_size = 0;
+            close(file);
+            return ERR_INVALID_DISK_FILE;
+        }
+    }
+
+    //everything below, the mapping checks, uring stage and cache slots, is sized by the block size
+    if((fs_block_size = probe_block_size(file)) < 0)
+    {
+        DEBUG2 && printf("open_fs: no superblock found\n");
+        fs_block_size = MIN_BLOCK_SIZE;
+        dio_destroy();
+        close(file);
+        return ERR_INVALID_DISK_FILE;
+    }
+
+    sb = malloc(BLOCK_SIZE);
+
+    if(mode & FS_OPEN_MMAP)
+    {
+        if(fstat(file, &st) < 0 || st.st_size < 2*BLOCK_SIZE)
+        {
+            DEBUG2 && printf("open_fs: disk file too small to map\n");
+            open_fs_abort(sb);
+            return ERR_INVALID_DISK_FILE;
+        }
+
+        fs_map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, file, 0);
+
+        if(fs_map == MAP_FAILED)
+        {
+            DEBUG2 && printf("open_fs: mmap failed\n");
+            fs_map = NULL;
+            open_fs_abort(sb);
+            return ERR_INTERNAL;
+        }
+
+        fs_map_size = st.st_size;
+    }
+    else if((mode & FS_OPEN_URING) && dio_size == 0)
+    {
+        //falls back to pread/pwrite when the kernel has no io_uring
+        uring_init();
+    }
+
+    if( !read_block(file, sb, 1) )
+    {
+        open_fs_abort(sb);
+        return ERR_FILE_NOT_FOUND;
+    }
+    if(sb->fs_type != 12345)
+    {
+        open_fs_abort(sb);
+        return ERR_INVALID_DISK_FILE;
+    }
+    if(sb->ext_magic == SB_EXT_MAGIC && sb->disk_blocks > 0)
+        NUM_BLOCKS = sb->disk_blocks;
+    else
+        NUM_BLOCKS = sb->disk_size / BLOCK_SIZE;
+    NUM_INODE_BLOCKS = NUM_BLOCKS / 32;
+    NUM_INODES_PER_BLOCK = INODES_PER_BLOCK;
+    NUM_INODES = NUM_INODE_BLOCKS * NUM_INODES_PER_BLOCK;
+
+    if(sb->ext_magic == SB_EXT_MAGIC)
+    {
+        fs_features = sb->features;
+        data_start = sb->data_start;
+    }
+    else
+    {
+        fs_features = 0;
+        data_start = NUM_INODE_BLOCKS + 2;
+    }
+
+    NUM_DATA_BLOCKS = NUM_BLOCKS - data_start;
+
+    fs_sb = sb;
+    sb_dirty = 0;
+
+    if((fs_features & FORMAT_BITMAP) && bitmap_load() != SUCCESS)
+    {
+        open_fs_abort(sb);
+        return ERR_INVALID_DISK_FILE;
+    }
+
+    //the mapping already is the cache
+    if(fs_map == NULL && cache_init() != SUCCESS)
+    {
+        open_fs_abort(sb);
+        return ERR_INTERNAL;
+    }
+
+    inode_cache_init();
+    dcache_clear();
+
+    return SUCCESS;
+}
+
+int close_fs()
+{
+    int ret = SUCCESS;
+    int i;
+
+    //handles point into the inode cache freed below, none of them outlives the file system
+    for(i = 0; i < MAX_OPEN_FILES; i++)
+    {
+        if(open_file_table[i].currently_opened && file_close(i) != SUCCESS)
+            ret = ERR_INTERNAL;
+    }
+
+    for(i = 0; i < MAX_OPEN_DIRS; i++)
+    {
+        file_closedir(i);
+    }
+
+    if(inode_cache_destroy() != SUCCESS)
+        ret = ERR_INTERNAL;
+
+    dcache_clear();
+
+    if(sync_superblock() != SUCCESS)
+        ret = ERR_INTERNAL;
+
+    free(fs_sb);
+    fs_sb = NULL;
+    bitmap_destroy();
+
+    if(fs_map != NULL)
+    {
+        if(msync(fs_map, fs_map_size, MS_SYNC))
+            ret = ERR_INTERNAL;
+        munmap(fs_map, fs_map_size);
+        fs_map = NULL;
+    }
+
+    if(cache_destroy() != SUCCESS)
+        ret = ERR_INTERNAL;
+
+    //whatever the writes above left staged
+    if(uring_destroy() != SUCCESS)
+        ret = ERR_INTERNAL;
+
+    dio_destroy();
+    close(file);
+
+    return ret;
+}
+
+int format_fs(char *fs_path, int num_blocks)
+{
+    return format_fs_opts(fs_path, num_blocks, MIN_BLOCK_SIZE, 0);
+}
+
+int format_fs_opts(char *fs_path, int num_blocks, int block_size, int flags)
+{
+    int ret = SUCCESS;
+    int i;
+    int bitmap_blocks = 0;
+    int first_data;
+
+    //a power of two so offsets and dio alignment work out
+    if(block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)))
+    {
+        DEBUG2 && printf("Unable to create file system. Invalid block size %d\n", block_size);
+        return ERR_INVALID_BLOCK_SIZE;
+    }
+
+    //without FORMAT_LARGE the size in bytes has to fit disk_size, either way inode numbers fit an int
+    if((!(flags & FORMAT_LARGE) && (long long)num_blocks * block_size > INT_MAX) ||
+       (long long)(num_blocks / 32) * (block_size / sizeof(struct inode)) > INT_MAX)
+    {
+        DEBUG2 && printf("Unable to create file system. Disk too large\n");
+        return ERR_DISK_TOO_LARGE;
+    }
+
+    fs_block_size = block_size;
+    NUM_BLOCKS = num_blocks;
+    NUM_INODE_BLOCKS = NUM_BLOCKS / 32;
+    NUM_INODES_PER_BLOCK = INODES_PER_BLOCK;
+    NUM_INODES = NUM_INODE_BLOCKS * NUM_INODES_PER_BLOCK;
+
+    //the bitmap takes its blocks from the front of the data area
+    if(flags & FORMAT_BITMAP)
+        bitmap_blocks = (NUM_BLOCKS - 2 - NUM_INODE_BLOCKS + BITS_PER_BLOCK) / (BITS_PER_BLOCK + 1);
+
+    first_data = 2 + NUM_INODE_BLOCKS + bitmap_blocks;
+    NUM_DATA_BLOCKS = NUM_BLOCKS - first_data;
+
+    if (NUM_BLOCKS < 32)
+    {
+        DEBUG2 && printf("Unable to create file system. Minimum blocks must be >= 32\n");
+        return ERR_MIN_BLOCKS;
+    }
+
+    //zeroed so no stale heap bytes end up on disk past the fields we set
+    struct bootblock *bootblock = calloc(1, BLOCK_SIZE);
+    struct superblock *superblock = calloc(1, BLOCK_SIZE);
+    struct inode_block *inode_block = calloc(1, BLOCK_SIZE);
+    struct inode *inode = calloc(1, sizeof(struct inode));
+    struct free_data_block *free_data_block = calloc(1, BLOCK_SIZE);
+    struct directory *root_dir = calloc(1, BLOCK_SIZE);
+
+    //a lazy format relies on every block it doesn't write reading back as zeros
+    if(flags & FORMAT_LAZY)
+        file = open(fs_path, O_RDWR|O_CREAT|O_TRUNC, 00777);
+    else
+        file = open(fs_path, O_RDWR|O_CREAT, 00777);
+
+    // Writing the bootblock to file
+    write_block(file, bootblock, 0);
+
+    // Writing the superblock to file
+    memset(superblock, 0, BLOCK_SIZE);
+    superblock->fs_type = 12345;
+    superblock->disk_size = (long long)NUM_BLOCKS * BLOCK_SIZE > INT_MAX ? 0 : NUM_BLOCKS * BLOCK_SIZE;
+    superblock->blocks_allocated = 1; // the root directory block
+    superblock->max_blocks = NUM_DATA_BLOCKS;
+    superblock->files_allocated = 1;
+    superblock->max_files = NUM_INODES;
+    superblock->free_inode_list = (flags & FORMAT_LAZY) ? -1 : 1;
+    superblock->free_data_block_list = (flags & (FORMAT_BITMAP|FORMAT_LAZY)) ? -1 : first_data + 1;
+    superblock->ext_magic = SB_EXT_MAGIC;
+    superblock->features = flags;
+    superblock->bitmap_start = 2 + NUM_INODE_BLOCKS;
+    superblock->bitmap_blocks = bitmap_blocks;
+    superblock->data_start = first_data;
+    superblock->inode_hwm = (flags & FORMAT_LAZY) ? 1 : NUM_INODES;
+    superblock->data_hwm = (flags & FORMAT_LAZY) ? 1 : NUM_DATA_BLOCKS;
+    superblock->block_size = BLOCK_SIZE;
+    superblock->disk_blocks = NUM_BLOCKS;
+    write_block(file, superblock, 1);
+
+    // Writing the inode block to file
+    int j;
+    int count = 0;
+
+    //lazily formatted inodes past inode_hwm are set up when first handed out
+    for (j = 0; j < ((flags & FORMAT_LAZY) ? 1 : NUM_INODE_BLOCKS); j++)
+    {
+        for(i = 0; i < NUM_INODES_PER_BLOCK; i++)
+        {
+            if(j == 0 && i == 0)
+            {
+                // This is the root
+                inode_block->inodes[i].is_dir = 1;
+                inode_block->inodes[i].num_blocks = 1;
+                //we shouldn't maintain pointers to next free inode on used inodes
+                inode_block->inodes[i].next_free_inode = -2;  //j + 1;
+                inode_block->inodes[i].is_free = 0;
+                if(flags & FORMAT_EXTENTS)
+                {
+                    inode_block->inodes[i].extents.entries = 1;
+                    inode_block->inodes[i].extents.depth = 0;
+                    inode_block->inodes[i].extents.ext[0].file_block = 0;
+                    inode_block->inodes[i].extents.ext[0].start = first_data;
+                    inode_block->inodes[i].extents.ext[0].len = 1;
+                }
+                else
+                    inode_block->inodes[i].file_blocks[0] = first_data;
+                continue;
+            }
+
+            inode_block->inodes[i].is_dir = 0;
+            inode_block->inodes[i].is_free = 1;
+            inode_block->inodes[i].num_blocks = 0;
+            //we dont want to point to zero since thats a valid block
+            inode_block->inodes[i].file_blocks[0] = -3;
+            //last free inode points to null
+
+            if(i == NUM_INODES_PER_BLOCK-1 && j == NUM_INODE_BLOCKS-1)
+                inode_block->inodes[i].next_free_inode = -1;
+
+            else
+                inode_block->inodes[i].next_free_inode = j*NUM_INODES_PER_BLOCK + i + 1;
+        }
+
+        write_block(file, inode_block, 2 + j);
+    }
+
+    if(flags & FORMAT_BITMAP)
+    {
+        // Writing the bitmap, only the root directory block is in use and
+        // the bits past the last data block are kept set
+        BYTE *bitmap = malloc(BLOCK_SIZE);
+
+        for(j = 0; j < bitmap_blocks; j++)
+        {
+            //after the truncate only blocks with bits set need writing
+            if((flags & FORMAT_LAZY) && j != 0 && (j + 1)*BITS_PER_BLOCK <= NUM_DATA_BLOCKS)
+                continue;
+
+            memset(bitmap, 0, BLOCK_SIZE);
+
+            for(i = 0; i < BITS_PER_BLOCK; i++)
+            {
+                int bit = j*BITS_PER_BLOCK + i;
+
+                if(bit == 0 || bit >= NUM_DATA_BLOCKS)
+                    bitmap[i / 8] |= 1 << (i % 8);
+            }
+
+            write_block(file, bitmap, 2 + NUM_INODE_BLOCKS + j);
+        }
+
+        // Free blocks are never read in this format, only the root dir is written
+        memset(root_dir, 0, BLOCK_SIZE);
+        write_block(file, root_dir, first_data);
+
+        free(bitmap);
+    }
+    else if(flags & FORMAT_LAZY)
+    {
+        // Blocks past data_hwm are handed out in order before the free list is used
+        memset(root_dir, 0, BLOCK_SIZE);
+        write_block(file, root_dir, first_data);
+    }
+    else
+    {
+        // The root dir first, the free list starts right after it
+        write_block(file, root_dir, first_data);
+
+        // Writing the free data blocks to file
+        for(i = 1; i < NUM_DATA_BLOCKS; i++)
+        {
+            if(i == NUM_DATA_BLOCKS - 1)
+                free_data_block->next_free_block = -1;
+
+            else
+                free_data_block->next_free_block = first_data + i + 1;
+
+            write_block(file, free_data_block, first_data + i);
+        }
+    }
+
+    // Extend the file to its full size without touching every block
+    if((flags & (FORMAT_BITMAP|FORMAT_LAZY)) && ftruncate(file, (off_t)NUM_BLOCKS * BLOCK_SIZE))
+    {
+        DEBUG2 && printf("Unable to create file system. Could not extend the disk file\n");
+        ret = ERR_INTERNAL;
+    }
+
+    free(bootblock);
+    free(superblock);
+    free(inode_block);
+    free(inode);
+    free(free_data_block);
+    free(root_dir);
+
+    close(file);
+    return ret;
+}
+
+
+struct inode_block *get_inode_block(int inode_num)
+{
+    struct inode_block *inode_blk;
+    int inode_block_num  = (inode_num / INODES_PER_BLOCK) + 2;
+    int s;
+
+    if(inode_num < 0 || inode_num >= NUM_INODES)
+    {
+        DEBUG1 && printf("get_inode_block: inode_num out of range\n");
+        DEBUG1 && printf("get_inode_block: inode_num = %d \n", inode_num);
+        DEBUG1 && printf("get_inode_block: NUM_INODES = %d \n", NUM_INODES);
+        return NULL;
+    }
+
+    inode_blk = malloc(BLOCK_SIZE);
+
+    if( !(read_block(file, inode_blk, inode_block_num)) )
+    {
+        DEBUG2 && printf("get_inode_block: failed to read inode block\n");
+        free(inode_blk);
+        inode_blk = NULL;
+    }
+
+    return inode_blk;
+}
+
+int put_inode_block(struct inode_block *ib, int inode_num)
+{
+    int inode_block_num = (inode_num / INODES_PER_BLOCK) + 2;
+
+    DEBUG1 && printf("inode_block_num = %d \n", inode_block_num);
+
+    if( !(write_block(file, ib, inode_block_num)) )
+    {
+        //free(inode_blk);
+        //inode_blk = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int icache_lookup(int inode_num)
+{
+    int slot = icache_hash[inode_num % INODE_CACHE_SIZE];
+
+    while(slot >= 0 && icache[slot]->inode_num != inode_num)
+    {
+        slot = icache[slot]->next;
+    }
+
+    return slot;
+}
+
+void icache_unhash(int slot)
+{
+    int *link = &icache_hash[icache[slot]->inode_num % INODE_CACHE_SIZE];
+
+    while(*link != slot)
+    {
+        link = &icache[*link]->next;
+    }
+
+    *link = icache[slot]->next;
+}
+
+//writes back every dirty cached inode in the same inode block as inode_num
+int inode_write_back(int inode_num)
+{
+    struct inode_block *ib = get_inode_block(inode_num);
+    int first = inode_num - (inode_num % INODES_PER_BLOCK);
+    int i, slot, s;
+
+    if(ib == NULL)
+        return -1;
+
+    for(i = first; i < first + INODES_PER_BLOCK && i < NUM_INODES; i++)
+    {
+        if((slot = icache_lookup(i)) >= 0 && icache[slot]->dirty)
+        {
+            ib->inodes[i - first] = icache[slot]->inode;
+            icache[slot]->dirty = 0;
+        }
+    }
+
+    s = put_inode_block(ib, inode_num);
+    free(ib);
+
+    return s;
+}
+
+//picks a slot for a new inode, CLOCK over the ones nobody holds
+int icache_slot(void)
+{
+    struct inode_cache_entry *e;
+    struct inode_cache_entry **grown;
+    int i, slot;
+
+    if(icache_used == icache_slots)
+    {
+        for(i = 0; i < 2*icache_slots; i++)
+        {
+            slot = icache_hand;
+            icache_hand = (icache_hand + 1) % icache_slots;
+            e = icache[slot];
+
+            if(e->refcount > 0)
+                continue;
+
+            if(e->referenced)
+            {
+                e->referenced = 0;
+                continue;
+            }
+
+            if(e->dirty && inode_write_back(e->inode_num))
+                continue;
+
+            icache_unhash(slot);
+            e->inode_num = -1;
+            return slot;
+        }
+
+        //every cached inode is held, make room rather than fail
+        grown = realloc(icache, sizeof(struct inode_cache_entry *) * icache_slots * 2);
+
+        if(grown == NULL)
+            return -1;
+
+        icache = grown;
+        icache_slots *= 2;
+    }
+
+    if((icache[icache_used] = malloc(sizeof(struct inode_cache_entry))) == NULL)
+        return -1;
+
+    icache[icache_used]->inode_num = -1;
+
+    return icache_used++;
+}
+
+//pass ref. to an inode pointer and inode number, returns 0 on success and points inode at the cached copy
+int get_inode(struct inode **inode, int inode_num)
+{
+    struct inode_block *ib;
+    struct inode_cache_entry *e;
+    int slot;
+
+    *inode = NULL;
+
+    if(inode_num < 0 || inode_num >= NUM_INODES)
+        return -1;
+
+    if(icache == NULL && inode_cache_init())
+        return -1;
+
+    if((slot = icache_lookup(inode_num)) < 0)
+    {
+        if((ib = get_inode_block(inode_num)) == NULL)
+            return -1;
+
+        if((slot = icache_slot()) < 0)
+        {
+            free(ib);
+            return -1;
+        }
+
+        e = icache[slot];
+        e->inode_num = inode_num;
+        e->inode = ib->inodes[inode_num % INODES_PER_BLOCK];
+        e->refcount = 0;
+        e->dirty = 0;
+        e->next = icache_hash[inode_num % INODE_CACHE_SIZE];
+        icache_hash[inode_num % INODE_CACHE_SIZE] = slot;
+
+        free(ib);
+    }
+
+    icache[slot]->refcount++;
+    icache[slot]->referenced = 1;
+    *inode = &icache[slot]->inode;
+
+    return 0;
+}
+
+void release_inode(int inode_num)
+{
+    int slot;
+
+    if(icache == NULL || inode_num < 0 || (slot = icache_lookup(inode_num)) < 0)
+        return;
+
+    if(icache[slot]->refcount > 0)
+        icache[slot]->refcount--;
+}
+
+void mark_inode_dirty(int inode_num)
+{
+    int slot;
+
+    if(icache == NULL || inode_num < 0 || (slot = icache_lookup(inode_num)) < 0)
+        return;
+
+    icache[slot]->dirty = 1;
+}
+
+int inode_cache_init(void)
+{
+    int i;
+
+    icache_slots = INODE_CACHE_SIZE;
+    icache_used = 0;
+    icache_hand = 0;
+
+    if((icache = malloc(sizeof(struct inode_cache_entry *) * icache_slots)) == NULL)
+        return -1;
+
+    for(i = 0; i < INODE_CACHE_SIZE; i++)
+    {
+        icache_hash[i] = -1;
+    }
+
+    return 0;
+}
+
+int inode_cache_flush(void)
+{
+    int ret = SUCCESS;
+    int i;
+
+    for(i = 0; icache != NULL && i < icache_used; i++)
+    {
+        if(icache[i]->inode_num >= 0 && icache[i]->dirty && inode_write_back(icache[i]->inode_num))
+            ret = ERR_INTERNAL;
+    }
+
+    return ret;
+}
+
+int inode_cache_destroy(void)
+{
+    int i, ret;
+
+    if(icache == NULL)
+        return SUCCESS;
+
+    ret = inode_cache_flush();
+
+    for(i = 0; i < icache_used; i++)
+    {
+        free(icache[i]);
+    }
+
+    free(icache);
+    icache = NULL;
+
+    return ret;
+}
+
+
+
+//find free inode, remove from free inode list, return inode number
+int get_free_inode(void)
+{
+    struct superblock *sb = fs_sb;
+    struct inode *inode;
+
+    int inode_num;
+    int new_free;
+    int i;
+
+    if( (inode_num = sb->free_inode_list) == -1)
+    {
+        //inodes past the high water mark were never initialised, take the next one
+        if((fs_features & FORMAT_LAZY) && sb->inode_hwm < NUM_INODES)
+        {
+            inode_num = sb->inode_hwm;
+        }
+        else
+        {
+            DEBUG2 && printf("Error no free inodes\n");
+            return -1;
+        }
+    }
+
+    if(get_inode(&inode, inode_num))
+    {
+        DEBUG2 && 	printf("ERROR: couldn't get inode \n ");
+        return -1;
+    }
+
+    if(inode_num == sb->free_inode_list)
+    {
+        new_free = inode->next_free_inode;
+    }
+    else
+    {
+        new_free = -1;
+        sb->inode_hwm++;
+    }
+
+    inode->next_free_inode = -2;
+    inode->is_free=0;
+    inode->num_blocks=0;
+    inode->is_dir=0;
+
+    for(i=0; i < 10 ; i++)
+    {
+        inode->file_blocks[i] = 0;
+    }
+
+    inode->indirect1 = 0;
+    inode->indirect2 = 0;
+
+
+    DEBUG1 && printf("new_free: %d \n", new_free);
+
+    sb->free_inode_list = new_free;
+    sb->files_allocated++;
+    superblock_changed();
+
+    mark_inode_dirty(inode_num);
+    release_inode(inode_num);
+
+    return inode_num;
+}
+
+int get_free_datablock(void)
+{
+    struct superblock *sb = fs_sb;
+    struct free_data_block *fdb = malloc(BLOCK_SIZE);
+    struct datablock *empty_db = malloc(BLOCK_SIZE);
+    int free_db_num, i, len;
+    int lazy = 0;
+
+    for(i=0; i < BLOCK_SIZE; i++)
+    {
+        empty_db->byte[i] = 0;
+    }
+
+    if(fs_bitmap != NULL)
+    {
+        //next fit straight out of the in-memory bitmap
+        if((free_db_num = bitmap_find_run(1, &len)) >= 0)
+        {
+            bitmap_mark(free_db_num, 1, 1);
+            bitmap_hint = free_db_num + 1;
+            free_db_num += data_start;
+        }
+    }
+    else
+    {
+        free_db_num = sb->free_data_block_list;
+
+        if(free_db_num < 0 && (fs_features & FORMAT_LAZY) && sb->data_hwm < NUM_DATA_BLOCKS)
+        {
+            //never used before, nothing to unlink
+            free_db_num = data_start + sb->data_hwm++;
+            lazy = 1;
+        }
+    }
+
+    if(free_db_num < 0)
+    {
+        free(fdb);
+        free(empty_db);
+        DEBUG1 && printf("no free data blocks \n");
+        return -1;
+    }
+
+    if(fs_bitmap == NULL && !lazy)
+    {
+        if(!read_block(file, fdb, free_db_num))
+        {
+            DEBUG2 && printf("Error reading superblock\n");
+            return -1;
+        }
+
+        sb->free_data_block_list = fdb->next_free_block;
+    }
+
+    sb->blocks_allocated++;
+    superblock_changed();
+
+    fdb->next_free_block = -1;
+
+    if(!write_block(file, empty_db, free_db_num))
+    {
+        DEBUG2 && printf("Error writing new datablock\n");
+        return -1;
+    }
+
+    free(fdb);
+    free(empty_db);
+
+    return free_db_num;
+}
+
+int get_free_datablocks(int count, BLOCK *blocks, int first_full, int num_full)
+{
+    BYTE *zero;
+    int got = 0;
+    int start, len, done, n, i, chunk;
+
+    if(fs_bitmap == NULL)
+    {
+        //the free list has no notion of neighbours, take them one at a time
+        while(got < count && (start = get_free_datablock()) >= 0)
+        {
+            blocks[got++] = start;
+        }
+        return got;
+    }
+
+    //zero up to MAX_IOV_BLOCKS of the smallest blocks per write, whatever the block size
+    chunk = MAX_IOV_BLOCKS * MIN_BLOCK_SIZE / BLOCK_SIZE;
+    if(chunk < 1)
+        chunk = 1;
+
+    if((zero = calloc(chunk, BLOCK_SIZE)) == NULL)
+    {
+        DEBUG2 && printf("get_free_datablocks: no memory for the zero buffer\n");
+        return 0;
+    }
+
+    while(got < count && (start = bitmap_find_run(count - got, &len)) >= 0 && len > 0)
+    {
+        bitmap_mark(start, len, 1);
+        bitmap_hint = start + len;
+        fs_sb->blocks_allocated += len;
+
+        for(i = 0; i < len; i++)
+        {
+            blocks[got + i] = data_start + start + i;
+        }
+
+        //the blocks the caller overwrites whole are not worth zeroing first
+        for(done = 0; done < len; done += n)
+        {
+            if(got + done >= first_full && got + done < first_full + num_full)
+            {
+                n = first_full + num_full - (got + done);
+                if(n > len - done)
+                    n = len - done;
+                continue;
+            }
+
+            n = len - done > chunk ? chunk : len - done;
+            if(got + done < first_full && got + done + n > first_full)
+                n = first_full - (got + done);
+
+            if(write_blocks(file, zero, data_start + start + done, n) != n*BLOCK_SIZE)
+            {
+                //never hand out a block that may still hold someone else's data
+                DEBUG2 && printf("get_free_datablocks: error zeroing block %d\n", data_start + start + done);
+                bitmap_mark(start + done, len - done, 0);
+                fs_sb->blocks_allocated -= len - done;
+                got += done;
+                superblock_changed();
+                free(zero);
+                return got;
+            }
+        }
+
+        got += len;
+    }
+
+    superblock_changed();
+    free(zero);
+
+    return got;
+}
+
+int inline_to_block(struct inode *inode, int inode_num)
+{
+    struct block_map map;
+    BYTE *buf;
+    int block_num, ret = 0;
+
+    if((block_num = get_free_datablock()) < 0)
+    {
+        DEBUG2 && printf("error no more free data blocks\n");
+        return -1;
+    }
+
+    buf = malloc(BLOCK_SIZE);
+    memset(buf, 0, BLOCK_SIZE);
+    memcpy(buf, inode->inline_data, INLINE_SIZE);
+
+    if(!write_block(file, buf, block_num))
+    {
+        DEBUG2 && printf("error writing datablock\n");
+        make_free_datablock(block_num);
+        free(buf);
+        return -1;
+    }
+
+    free(buf);
+
+    //map it as block 0 of an otherwise empty file
+    memset(&inode->inline_mark, 0, sizeof(BLOCK) + INLINE_SIZE);
+    inode->num_blocks = 0;
+    memset(&map, 0, sizeof(struct block_map));
+
+    if(bmap_set(&map, inode, 0, block_num) || bmap_flush(&map))
+        ret = -1;
+
+    bmap_release(&map);
+    inode->num_blocks = 1;
+
+    mark_inode_dirty(inode_num);
+    bmap_invalidate(inode_num);
+
+    return ret;
+}
+
+int add_data_blocks(int inode_num, int count, BLOCK *blocks)
+{
+    return add_data_blocks_for(inode_num, count, blocks, 0, 0);
+}
+
+int add_data_blocks_for(int inode_num, int count, BLOCK *blocks, long long start, long long end)
+{
+    struct inode *inode;
+    struct block_map map;
+    BLOCK *new_blocks;
+    int got, added, idx, old_blocks, first_full, last_full;
+    int failed = 0;
+
+    //no point asking for more than the disk has left
+    if(count > fs_sb->max_blocks - fs_sb->blocks_allocated)
+        count = fs_sb->max_blocks - fs_sb->blocks_allocated;
+
+    if(count <= 0)
+        return 0;
+
+    if(get_inode(&inode, inode_num))
+    {
+        DEBUG2 && printf("inode is null\n");
+        return 0;
+    }
+
+    //an inline file needs its one block on disk before it can have more
+    if(IS_INLINE(inode) && inline_to_block(inode, inode_num))
+    {
+        release_inode(inode_num);
+        return 0;
+    }
+
+    if((new_blocks = malloc(sizeof(BLOCK) * count)) == NULL)
+    {
+        release_inode(inode_num);
+        return 0;
+    }
+
+    //new block idx becomes file block old_blocks + idx, only those wholly inside [start, end) skip zeroing
+    old_blocks = inode->num_blocks;
+    first_full = (start + BLOCK_SIZE-1) / BLOCK_SIZE - old_blocks;
+    last_full = end / BLOCK_SIZE - old_blocks;
+    if(first_full < 0)
+        first_full = 0;
+    if(last_full > count)
+        last_full = count;
+
+    if((got = get_free_datablocks(count, new_blocks, first_full,
+                                  last_full > first_full ? last_full - first_full : 0)) == 0)
+    {
+        release_inode(inode_num);
+        free(new_blocks);
+        return 0;
+    }
+
+    //indirection blocks are loaded once and written once for the whole batch
+    memset(&map, 0, sizeof(struct block_map));
+
+    for(added = 0; added < got; added++)
+    {
+        if(inode->num_blocks >= max_file_blocks())
+        {
+            DEBUG2 && printf("Error: cannot add another block, filesize max reached\n");
+            break;
+        }
+
+        if(bmap_set(&map, inode, inode->num_blocks, new_blocks[added]))
+        {
+            DEBUG2 && printf("Error mapping new block\n");
+            break;
+        }
+
+        if(blocks != NULL)
+            blocks[added] = new_blocks[added];
+
+        inode->num_blocks++;
+    }
+
+    //anything we allocated but could not map goes back
+    for(idx = added; idx < got; idx++)
+    {
+        make_free_datablock(new_blocks[idx]);
+    }
+
+    if(bmap_flush(&map))
+    {
+        //the new blocks are not reachable on disk, give all of them back
+        DEBUG2 && printf("Error writing indirection block\n");
+
+        for(idx = 0; idx < added; idx++)
+        {
+            make_free_datablock(new_blocks[idx]);
+        }
+
+        inode->num_blocks = old_blocks;
+        added = 0;
+        failed = 1;
+    }
+
+    bmap_release(&map);
+
+    //and so do the indirection blocks allocated for them
+    if(failed)
+        trim_inode_indirection(inode, inode_num);
+
+    mark_inode_dirty(inode_num);
+    release_inode(inode_num);
+    bmap_invalidate(inode_num);
+
+    free(new_blocks);
+
+    return added;
+}
+
+int add_data_block(int inode_num)
+{
+    BLOCK new_db_num;
+
+    if(add_data_blocks(inode_num, 1, &new_db_num) != 1)
+        return -1;
+
+    DEBUG1 && printf("new db number: %d \n", new_db_num);
+
+    return new_db_num;
+}
+
+int add_dir_to_inode(int inode_num, char *n_dir, int n_inode_num)
+{
+    struct inode *inode = NULL;
+    int s;
+
+    if(get_inode(&inode, inode_num))
+        return ERR_INTERNAL;
+
+    s = add_dir_entry(inode, inode_num, n_dir, n_inode_num);
+    release_inode(inode_num);
+
+    if(s == SUCCESS)
+        dcache_set(inode_num, n_dir, n_inode_num);
+
+    return s;
+}
+
+unsigned int dir_hash(char *name)
+{
+    //FNV-1a, it is on disk so it can never change
+    unsigned int h = 2166136261u;
+
+    while(*name)
+    {
+        h ^= (BYTE)*name++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+void dir_trim(struct inode *inode, int inode_num, int num_blocks)
+{
+    while(inode->num_blocks > num_blocks)
+    {
+        make_free_datablock(bmap(inode, inode->num_blocks - 1));
+        inode->num_blocks--;
+        trim_inode_indirection(inode, inode_num);
+    }
+
+    mark_inode_dirty(inode_num);
+}
+
+int dir_index_create(struct inode *inode, int inode_num)
+{
+    struct directory *old, *lo, *hi;
+    struct dir_index *index;
+    struct dir_slot_block *table;
+    BLOCK blocks[3];
+    int k, nlo, nhi, s = SUCCESS;
+
+    //directory blocks 1 to 3 become the table and the two buckets, block 0 the index
+    if(add_data_blocks(inode_num, 3, blocks) != 3)
+    {
+        dir_trim(inode, inode_num, 1);
+        return ERR_DISK_FULL;
+    }
+
+    if(get_data_block((struct datablock **)&old, inode, 0) < 0)
+    {
+        dir_trim(inode, inode_num, 1);
+        return ERR_INTERNAL;
+    }
+
+    lo = calloc(1, BLOCK_SIZE);
+    hi = calloc(1, BLOCK_SIZE);
+    table = calloc(1, BLOCK_SIZE);
+    index = calloc(1, BLOCK_SIZE);
+    nlo = nhi = 0;
+
+    for(k = 0; k < DIRENTS_PER_BLOCK; k++)
+    {
+        if(old->entries[k].inode_number <= 0)
+            continue;
+
+        if(dir_hash(old->entries[k].filename) & 1)
+            hi->entries[nhi++] = old->entries[k];
+        else
+            lo->entries[nlo++] = old->entries[k];
+    }
+
+    table->slots[0].block = 2;
+    table->slots[0].depth = 1;
+    table->slots[1].block = 3;
+    table->slots[1].depth = 1;
+
+    index->depth = 1;
+    index->num_table = 1;
+    index->table[0] = 1;
+
+    //the old entries are only overwritten by the index once the buckets hold them
+    if(!write_block(file, lo, blocks[1]) || !write_block(file, hi, blocks[2]) ||
+       !write_block(file, table, blocks[0]) || !write_block(file, index, bmap(inode, 0)))
+    {
+        DEBUG2 && printf("error writing dir block\n");
+        s = ERR_INTERNAL;
+    }
+    else
+    {
+        inode->is_dir = DIR_HASHED;
+        mark_inode_dirty(inode_num);
+    }
+
+    free(old);
+    free(lo);
+    free(hi);
+    free(table);
+    free(index);
+
+    return s;
+}
+
+int dir_bucket(struct inode *inode, char *name)
+{
+    struct dir_index *index;
+    struct dir_slot_block *table;
+    unsigned int slot;
+    int block;
+
+    if(get_data_block((struct datablock **)&index, inode, 0) < 0)
+        return -1;
+
+    slot = dir_hash(name) & ((1u << index->depth) - 1);
+    block = index->table[slot / DIR_SLOTS_PER_BLOCK];
+    free(index);
+
+    if(get_data_block((struct datablock **)&table, inode, block) < 0)
+        return -1;
+
+    block = table->slots[slot % DIR_SLOTS_PER_BLOCK].block;
+    free(table);
+
+    return block;
+}
+
+int dir_is_bucket(struct dir_index *index, int block)
+{
+    int t;
+
+    if(block == 0)
+        return 0;
+
+    for(t = 0; t < index->num_table; t++)
+    {
+        if(index->table[t] == block)
+            return 0;
+    }
+
+    return 1;
+}
+
+int dir_grow(struct inode *inode, int inode_num, struct dir_index *index)
+{
+    struct dir_slot_block *table;
+    BLOCK *blocks;
+    int n = 1 << index->depth;
+    int have = index->num_table;
+    int start = inode->num_blocks;
+    int block_num, i, s = SUCCESS;
+
+    if((2 * n + DIR_SLOTS_PER_BLOCK - 1) / DIR_SLOTS_PER_BLOCK > DIR_MAX_TABLE)
+    {
+        DEBUG2 && printf("error directory table is as big as it gets\n");
+        return ERR_DISK_FULL;
+    }
+
+    //while the table fits in one block the new slots go right after the old ones
+    if(2 * n <= DIR_SLOTS_PER_BLOCK)
+    {
+        if((block_num = get_data_block((struct datablock **)&table, inode, index->table[0])) < 0)
+            return ERR_INTERNAL;
+
+        memcpy(&table->slots[n], &table->slots[0], n * sizeof(struct dir_slot));
+
+        if(!write_block(file, table, block_num))
+            s = ERR_INTERNAL;
+
+        free(table);
+    }
+    else
+    {
+        //otherwise whole table blocks get copied, block have + i of the table is block i again
+        blocks = malloc(sizeof(BLOCK) * have);
+
+        if(add_data_blocks(inode_num, have, blocks) != have)
+        {
+            dir_trim(inode, inode_num, start);
+            free(blocks);
+            return ERR_DISK_FULL;
+        }
+
+        for(i = 0; i < have && s == SUCCESS; i++)
+        {
+            if(get_data_block((struct datablock **)&table, inode, index->table[i]) < 0)
+            {
+                s = ERR_INTERNAL;
+                break;
+            }
+
+            if(!write_block(file, table, blocks[i]))
+                s = ERR_INTERNAL;
+
+            free(table);
+        }
+
+        free(blocks);
+
+        if(s != SUCCESS)
+        {
+            dir_trim(inode, inode_num, start);
+            return s;
+        }
+
+        for(i = 0; i < have; i++)
+        {
+            index->table[have + i] = start + i;
+        }
+
+        index->num_table = 2 * have;
+    }
+
+    if(s != SUCCESS)
+        return s;
+
+    index->depth++;
+
+    if(!write_block(file, index, bmap(inode, 0)))
+    {
+        DEBUG2 && printf("error writing dir index\n");
+        return ERR_INTERNAL;
+    }
+
+    return SUCCESS;
+}
+
+int dir_split(struct inode *inode, int inode_num, char *name)
+{
+    struct dir_index *index;
+    struct dir_slot_block *table;
+    struct directory *lo, *hi;
+    struct dir_slot slot;
+    unsigned int hash = dir_hash(name);
+    unsigned int n, i, low;
+    int t, k, nlo, nhi, changed, table_block, new_block, block_num, s = SUCCESS;
+
+    if(get_data_block((struct datablock **)&index, inode, 0) < 0)
+        return ERR_INTERNAL;
+
+    n = 1u << index->depth;
+    i = hash & (n - 1);
+
+    if(get_data_block((struct datablock **)&table, inode, index->table[i / DIR_SLOTS_PER_BLOCK]) < 0)
+    {
+        free(index);
+        return ERR_INTERNAL;
+    }
+
+    slot = table->slots[i % DIR_SLOTS_PER_BLOCK];
+    free(table);
+
+    //the bucket has its slot to itself, the table doubles so it gets two
+    if(slot.depth == index->depth)
+    {
+        if((s = dir_grow(inode, inode_num, index)) != SUCCESS)
+        {
+            free(index);
+            return s;
+        }
+
+        n *= 2;
+    }
+
+    if((block_num = add_data_block(inode_num)) < 0)
+    {
+        free(index);
+        return ERR_DISK_FULL;
+    }
+
+    new_block = inode->num_blocks - 1;
+
+    if(get_data_block((struct datablock **)&lo, inode, slot.block) < 0)
+    {
+        dir_trim(inode, inode_num, new_block);
+        free(index);
+        return ERR_INTERNAL;
+    }
+
+    //the entries with the next bit of their hash set move to the new bucket
+    hi = calloc(1, BLOCK_SIZE);
+    nlo = nhi = 0;
+
+    for(k = 0; k < DIRENTS_PER_BLOCK; k++)
+    {
+        if(lo->entries[k].inode_number <= 0)
+            continue;
+
+        if((dir_hash(lo->entries[k].filename) >> slot.depth) & 1)
+            hi->entries[nhi++] = lo->entries[k];
+        else
+            lo->entries[nlo++] = lo->entries[k];
+    }
+
+    memset(&lo->entries[nlo], 0, (DIRENTS_PER_BLOCK - nlo) * sizeof(struct directory_entry));
+
+    if(!write_block(file, hi, block_num))
+    {
+        DEBUG2 && printf("error writing dir block\n");
+        dir_trim(inode, inode_num, new_block);
+        s = ERR_INTERNAL;
+    }
+
+    //then half of the bucket's slots, the ones with that bit set, are pointed at the new one
+    low = hash & ((1u << slot.depth) - 1);
+
+    for(t = 0; t < index->num_table && s == SUCCESS; t++)
+    {
+        if((table_block = get_data_block((struct datablock **)&table, inode, index->table[t])) < 0)
+        {
+            s = ERR_INTERNAL;
+            break;
+        }
+
+        changed = 0;
+
+        for(k = 0; k < DIR_SLOTS_PER_BLOCK && (unsigned int)(t * DIR_SLOTS_PER_BLOCK + k) < n; k++)
+        {
+            i = t * DIR_SLOTS_PER_BLOCK + k;
+
+            if((i & ((1u << slot.depth) - 1)) == low)
+            {
+                table->slots[k].depth = slot.depth + 1;
+
+                if((i >> slot.depth) & 1)
+                    table->slots[k].block = new_block;
+
+                changed = 1;
+            }
+        }
+
+        if(changed && !write_block(file, table, table_block))
+        {
+            DEBUG2 && printf("error writing dir table\n");
+            s = ERR_INTERNAL;
+        }
+
+        free(table);
+    }
+
+    //the moved entries leave the old bucket last, so a failure above loses none of them
+    if(s == SUCCESS && !write_block(file, lo, bmap(inode, slot.block)))
+    {
+        DEBUG2 && printf("error writing dir block\n");
+        s = ERR_INTERNAL;
+    }
+
+    free(lo);
+    free(hi);
+    free(index);
+
+    return s;
+}
+
+int dir_hashed_add(struct inode *inode, int inode_num, char *n_dir, int n_inode_num)
+{
+    struct directory *dir;
+    int data_block_num, block, i, s;
+
+    for(;;)
+    {
+        if((block = dir_bucket(inode, n_dir)) < 0 ||
+           (data_block_num = get_data_block((struct datablock **)&dir, inode, block)) < 0)
+        {
+            DEBUG2 && printf("error reading dir block\n");
+            return ERR_INTERNAL;
+        }
+
+        for(i = 0; i < DIRENTS_PER_BLOCK; i++)
+        {
+            if(dir->entries[i].inode_number <= 0)
+            {
+                dir->entries[i].inode_number = n_inode_num;
+                strcpy(dir->entries[i].filename, n_dir);
+
+                s = write_block(file, dir, data_block_num) ? SUCCESS : ERR_INTERNAL;
+                free(dir);
+                return s;
+            }
+        }
+
+        free(dir);
+
+        //the bucket is full, split it and try again
+        if((s = dir_split(inode, inode_num, n_dir)) != SUCCESS)
+            return s;
+    }
+}
+
+int dir_hashed_remove(struct inode *inode, char *name)
+{
+    struct directory *dir;
+    int data_block_num, j, k;
+
+    if((data_block_num = dir_bucket(inode, name)) < 0 ||
+       (data_block_num = get_data_block((struct datablock **)&dir, inode, data_block_num)) < 0)
+        return -1;
+
+    for(j = 0; j < DIRENTS_PER_BLOCK && strcmp(name, dir->entries[j].filename) != 0; j++)
+        ;
+
+    if(j == DIRENTS_PER_BLOCK)
+    {
+        free(dir);
+        return -1;
+    }
+
+    //keep the bucket packed, its last entry fills the hole
+    for(k = j; k + 1 < DIRENTS_PER_BLOCK && dir->entries[k + 1].inode_number > 0; k++)
+        ;
+
+    dir->entries[j] = dir->entries[k];
+    memset(&dir->entries[k], 0, sizeof(struct directory_entry));
+
+    if(!write_block(file, dir, data_block_num))
+    {
+        free(dir);
+        return -1;
+    }
+
+    free(dir);
+
+    return SUCCESS;
+}
+
+void *dir_batch_block(struct dir_batch *d, int block)
+{
+    if(d->blocks[block] == NULL && get_data_block((struct datablock **)&d->blocks[block], d->inode, block) < 0)
+        return NULL;
+
+    return d->blocks[block];
+}
+
+int dir_batch_bucket(struct dir_batch *d, unsigned int hash)
+{
+    struct dir_index *index = d->blocks[0];
+    struct dir_slot_block *table;
+    unsigned int slot = hash & ((1u << index->depth) - 1);
+
+    table = d->blocks[index->table[slot / DIR_SLOTS_PER_BLOCK]];
+
+    return table->slots[slot % DIR_SLOTS_PER_BLOCK].block;
+}
+
+int dir_batch_add_blocks(struct dir_batch *d, int count)
+{
+    int first = d->inode->num_blocks;
+    int b;
+
+    //they are only ever written whole from memory, so they are not zeroed on disk first
+    if(add_data_blocks_for(d->inode_num, count, NULL, (long long)first * BLOCK_SIZE,
+                           (long long)(first + count) * BLOCK_SIZE) != count)
+    {
+        dir_trim(d->inode, d->inode_num, first);
+        return -1;
+    }
+
+    while(d->cap < first + count)
+    {
+        d->blocks = realloc(d->blocks, 2 * d->cap * sizeof(void *));
+        d->dirty = realloc(d->dirty, 2 * d->cap);
+        memset(&d->blocks[d->cap], 0, d->cap * sizeof(void *));
+        memset(&d->dirty[d->cap], 0, d->cap);
+        d->cap *= 2;
+    }
+
+    for(b = first; b < first + count; b++)
+    {
+        if((d->blocks[b] = calloc(1, BLOCK_SIZE)) == NULL)
+        {
+            while(--b >= first)
+            {
+                free(d->blocks[b]);
+                d->blocks[b] = NULL;
+            }
+
+            dir_trim(d->inode, d->inode_num, first);
+            return -1;
+        }
+
+        d->dirty[b] = 1;
+    }
+
+    return first;
+}
+
+int dir_batch_split(struct dir_batch *d, unsigned int hash)
+{
+    struct dir_index *index = d->blocks[0];
+    struct dir_slot_block *table;
+    struct directory *lo, *hi;
+    struct dir_slot slot;
+    unsigned int n = 1u << index->depth;
+    unsigned int i, low;
+    int t, k, nlo, nhi, have, first, new_block;
+
+    table = d->blocks[index->table[(hash & (n - 1)) / DIR_SLOTS_PER_BLOCK]];
+    slot = table->slots[(hash & (n - 1)) % DIR_SLOTS_PER_BLOCK];
+
+    //same as dir_grow, the table doubles when the bucket has its slot to itself
+    if(slot.depth == index->depth)
+    {
+        if((2 * n + DIR_SLOTS_PER_BLOCK - 1) / DIR_SLOTS_PER_BLOCK > DIR_MAX_TABLE)
+        {
+            DEBUG2 && printf("error directory table is as big as it gets\n");
+            return ERR_DISK_FULL;
+        }
+
+        if(2 * n <= DIR_SLOTS_PER_BLOCK)
+        {
+            table = d->blocks[index->table[0]];
+            memcpy(&table->slots[n], &table->slots[0], n * sizeof(struct dir_slot));
+            d->dirty[index->table[0]] = 1;
+        }
+        else
+        {
+            have = index->num_table;
+
+            if((first = dir_batch_add_blocks(d, have)) < 0)
+                return ERR_DISK_FULL;
+
+            for(t = 0; t < have; t++)
+            {
+                memcpy(d->blocks[first + t], d->blocks[index->table[t]], BLOCK_SIZE);
+                index->table[have + t] = first + t;
+            }
+
+            index->num_table = 2 * have;
+        }
+
+        index->depth++;
+        d->dirty[0] = 1;
+        n *= 2;
+    }
+
+    if((new_block = dir_batch_add_blocks(d, 1)) < 0)
+        return ERR_DISK_FULL;
+
+    lo = d->blocks[slot.block];
+    hi = d->blocks[new_block];
+    nlo = nhi = 0;
+
+    for(k = 0; k < DIRENTS_PER_BLOCK; k++)
+    {
+        if(lo->entries[k].inode_number <= 0)
+            continue;
+
+        if((dir_hash(lo->entries[k].filename) >> slot.depth) & 1)
+            hi->entries[nhi++] = lo->entries[k];
+        else
+            lo->entries[nlo++] = lo->entries[k];
+    }
+
+    memset(&lo->entries[nlo], 0, (DIRENTS_PER_BLOCK - nlo) * sizeof(struct directory_entry));
+    d->dirty[slot.block] = 1;
+
+    //every slot that pointed at the bucket goes one deeper, those with the next bit set to the new one
+    low = hash & ((1u << slot.depth) - 1);
+
+    for(i = low; i < n; i += 1u << slot.depth)
+    {
+        t = index->table[i / DIR_SLOTS_PER_BLOCK];
+        table = d->blocks[t];
+        table->slots[i % DIR_SLOTS_PER_BLOCK].depth = slot.depth + 1;
+
+        if((i >> slot.depth) & 1)
+            table->slots[i % DIR_SLOTS_PER_BLOCK].block = new_block;
+
+        d->dirty[t] = 1;
+    }
+
+    return SUCCESS;
+}
+
+int dir_hashed_add_batch(struct inode *inode, int inode_num, char **names, int *inodes, int count)
+{
+    struct dir_batch d;
+    struct dir_index *index;
+    struct directory *dir;
+    int m, f, k, j, b, t, s = SUCCESS;
+
+    d.inode = inode;
+    d.inode_num = inode_num;
+    d.start = inode->num_blocks;
+    d.cap = inode->num_blocks + 16;
+    d.blocks = calloc(d.cap, sizeof(void *));
+    d.dirty = calloc(d.cap, 1);
+
+    //the index and the table are small and needed for every name, they stay in memory
+    if((index = dir_batch_block(&d, 0)) == NULL)
+        s = ERR_INTERNAL;
+
+    for(t = 0; s == SUCCESS && t < index->num_table; t++)
+    {
+        if(dir_batch_block(&d, index->table[t]) == NULL)
+            s = ERR_INTERNAL;
+    }
+
+    //each name goes in its bucket in memory, a full bucket is split in memory too
+    for(m = 0; s == SUCCESS && m < count; m++)
+    {
+        for(;;)
+        {
+            b = dir_batch_bucket(&d, dir_hash(names[m]));
+
+            if((dir = dir_batch_block(&d, b)) == NULL)
+                break;
+
+            for(k = 0; k < DIRENTS_PER_BLOCK && dir->entries[k].inode_number > 0 &&
+                       strcmp(dir->entries[k].filename, names[m]) != 0; k++)
+                ;
+
+            //buckets are packed, a free slot means the name is not there
+            if(k < DIRENTS_PER_BLOCK || dir_batch_split(&d, dir_hash(names[m])) != SUCCESS)
+                break;
+        }
+
+        if(dir == NULL || k == DIRENTS_PER_BLOCK || dir->entries[k].inode_number > 0)
+            break;
+
+        strcpy(dir->entries[k].filename, names[m]);
+        dir->entries[k].inode_number = inodes[m];
+        d.dirty[b] = 1;
+    }
+
+    if(s != SUCCESS)
+        m = 0;
+
+    //the new blocks first, nothing on disk points at them until the table and index do
+    for(b = d.start; b < inode->num_blocks; b++)
+    {
+        if(!write_block(file, d.blocks[b], bmap(inode, b)))
+        {
+            DEBUG2 && printf("error writing dir block\n");
+            dir_trim(inode, inode_num, d.start);
+            m = 0;
+            break;
+        }
+    }
+
+    index = d.blocks[0];
+
+    if(m > 0)
+    {
+        for(t = 0; t < index->num_table; t++)
+        {
+            b = index->table[t];
+
+            if(b < d.start && d.dirty[b] && !write_block(file, d.blocks[b], bmap(inode, b)))
+                s = ERR_INTERNAL;
+        }
+
+        if(s == SUCCESS && d.dirty[0] && !write_block(file, index, bmap(inode, 0)))
+            s = ERR_INTERNAL;
+
+        //part of the table may be on disk and point at the new buckets, keep all of their inodes
+        if(s != SUCCESS)
+        {
+            DEBUG2 && printf("error writing dir table\n");
+
+            for(k = 0; k < m; k++)
+            {
+                inodes[k] = 0;
+            }
+        }
+    }
+
+    //the old buckets last, so a failure above loses none of the entries split out of them
+    if(m > 0 && s == SUCCESS)
+    {
+        for(b = 1; b < d.start; b++)
+        {
+            if(d.dirty[b] && dir_is_bucket(index, b) && !write_block(file, d.blocks[b], bmap(inode, b)))
+            {
+                DEBUG2 && printf("error writing dir block\n");
+                d.dirty[b] = 2;
+            }
+        }
+
+        //a bucket that could not be written lost its names, those after the first of them come back out
+        for(f = 0; f < m && d.dirty[dir_batch_bucket(&d, dir_hash(names[f]))] != 2; f++)
+            ;
+
+        for(k = f; k < m; k++)
+        {
+            b = dir_batch_bucket(&d, dir_hash(names[k]));
+
+            if(d.dirty[b] == 2)
+                continue;
+
+            dir = d.blocks[b];
+
+            for(j = 0; strcmp(dir->entries[j].filename, names[k]) != 0; j++)
+                ;
+
+            for(t = j; t + 1 < DIRENTS_PER_BLOCK && dir->entries[t + 1].inode_number > 0; t++)
+                ;
+
+            dir->entries[j] = dir->entries[t];
+            memset(&dir->entries[t], 0, sizeof(struct directory_entry));
+            d.dirty[b] = 3;
+        }
+
+        for(k = f; k < m; k++)
+        {
+            b = dir_batch_bucket(&d, dir_hash(names[k]));
+
+            if(d.dirty[b] == 3 && !write_block(file, d.blocks[b], bmap(inode, b)))
+                d.dirty[b] = 4;
+
+            if(d.dirty[b] == 4)
+                inodes[k] = 0;
+        }
+
+        m = f;
+    }
+
+    for(b = 0; b < d.cap; b++)
+    {
+        free(d.blocks[b]);
+    }
+
+    free(d.blocks);
+    free(d.dirty);
+
+    return s == SUCCESS ? m : s;
+}
+
+struct dentry_cache_entry *dcache_slot(int parent, char *name)
+{
+    return &dcache[(dir_hash(name) ^ (unsigned int)parent * 2654435761u) % DENTRY_CACHE_SIZE];
+}
+
+int dcache_lookup(int parent, char *name, int *inode_num)
+{
+    struct dentry_cache_entry *d = dcache_slot(parent, name);
+
+    if(d->parent != parent || strcmp(d->name, name) != 0)
+        return 0;
+
+    *inode_num = d->inode_num;
+    return 1;
+}
+
+void dcache_set(int parent, char *name, int inode_num)
+{
+    struct dentry_cache_entry *d;
+
+    //names too long to be in a directory are not worth a slot
+    if(strlen(name) >= sizeof(d->name))
+        return;
+
+    d = dcache_slot(parent, name);
+    d->parent = parent;
+    strcpy(d->name, name);
+    d->inode_num = inode_num;
+}
+
+void dcache_forget_dir(int parent)
+{
+    int i;
+
+    for(i = 0; i < DENTRY_CACHE_SIZE; i++)
+    {
+        if(dcache[i].parent == parent)
+            dcache[i].parent = -1;
+    }
+}
+
+void dcache_clear(void)
+{
+    int i;
+
+    for(i = 0; i < DENTRY_CACHE_SIZE; i++)
+    {
+        dcache[i].parent = -1;
+    }
+}
+
+int dir_is_empty(struct inode *inode)
+{
+    struct directory *dir;
+    struct dir_index *index;
+    int i, k;
+
+    //a plain directory gives its last block back when its last entry goes
+    if(inode->is_dir != DIR_HASHED)
+        return inode->num_blocks == 0;
+
+    if(get_data_block((struct datablock **)&index, inode, 0) < 0)
+        return 0;
+
+    for(i = 0; i < inode->num_blocks; i++)
+    {
+        if(!dir_is_bucket(index, i))
+            continue;
+
+        if(get_data_block((struct datablock **)&dir, inode, i) < 0)
+        {
+            free(index);
+            return 0;
+        }
+
+        for(k = 0; k < DIRENTS_PER_BLOCK; k++)
+        {
+            if(dir->entries[k].inode_number > 0)
+            {
+                free(dir);
+                free(index);
+                return 0;
+            }
+        }
+
+        free(dir);
+    }
+
+    free(index);
+
+    return 1;
+}
+
+int add_dir_entry(struct inode *inode, int inode_num, char *n_dir, int n_inode_num)
+{
+    struct directory *nd = malloc(BLOCK_SIZE);
+    struct directory *cur_dir = NULL;
+    struct datablock *datablock = NULL;
+
+
+    int data_block_num;
+    int i;
+    int new_dir_block_num;
+
+    if(inode->is_dir == DIR_HASHED)
+    {
+        free(nd);
+        return dir_hashed_add(inode, inode_num, n_dir, n_inode_num);
+    }
+
+    for(i=0 ; i < DIRENTS_PER_BLOCK ; i++)
+    {
+        strcpy(nd->entries[i].filename,"");
+        nd->entries[i].inode_number = 0;
+    }
+
+    if(inode->num_blocks == 0)
+    {
+        new_dir_block_num = add_data_block(inode_num);
+
+        if(new_dir_block_num < 0)
+        {
+            return ERR_DISK_FULL;
+        }
+
+        strcpy(nd->entries[0].filename, n_dir);
+        nd->entries[0].inode_number = n_inode_num;
+
+        if(!write_block(file, nd, new_dir_block_num))
+        {
+            DEBUG2 && printf("error reading datablock\n");
+            return ERR_INTERNAL;
+        }
+        return SUCCESS;
+    }
+
+    if(inode->num_blocks > 0)
+    {
+        //int dir_block_num = inode->num_blocks - 1;
+        data_block_num = get_data_block(&datablock, inode, inode->num_blocks - 1);
+        cur_dir = (struct directory *)datablock;
+
+        for(i=0; i < DIRENTS_PER_BLOCK ; i++)
+        {
+            if(cur_dir->entries[i].inode_number <= 0)
+            {
+                cur_dir->entries[i].inode_number = n_inode_num;
+                strcpy(cur_dir->entries[i].filename, n_dir);
+
+                if( !write_block(file, cur_dir, data_block_num))
+                {
+                    DEBUG2 && printf("error reading datablock\n");
+                    return ERR_INTERNAL;
+                }
+                return SUCCESS;
+            }
+        }
+        free(datablock);
+
+        //a directory outgrowing its first block becomes a hash table of blocks
+        if((fs_features & FORMAT_DIR_INDEX) && inode->num_blocks == 1)
+        {
+            free(nd);
+
+            if((i = dir_index_create(inode, inode_num)) != SUCCESS)
+                return i;
+
+            return dir_hashed_add(inode, inode_num, n_dir, n_inode_num);
+        }
+
+        //we got here, we need another data block
+        new_dir_block_num = add_data_block(inode_num);
+        if(new_dir_block_num < 0)
+        {
+            DEBUG2 && printf("error no more free data blocks\n");
+            return ERR_DISK_FULL;
+        }
+        strcpy(nd->entries[0].filename, n_dir);
+        nd->entries[0].inode_number = n_inode_num;
+
+        if(!write_block(file, nd, new_dir_block_num))
+        {
+            DEBUG2 && printf("error writing datablock\n");
+            return ERR_INTERNAL;
+        }
+        return SUCCESS;
+
+    }
+
+    return SUCCESS;
+}
+
+int bmap(struct inode *inode, int file_block_num)
+{
+    struct block_map map;
+    int block_num;
+
+    memset(&map, 0, sizeof(struct block_map));
+    block_num = bmap_cached(&map, inode, file_block_num);
+    bmap_release(&map);
+
+    return block_num;
+}
+
+BLOCK *inode_root(struct inode *inode, int levels)
+{
+    if(levels == 1)
+        return &inode->indirect1;
+    if(levels == 2)
+        return &inode->indirect2;
+    return &INDIRECT3(inode);
+}
+
+int max_file_blocks(void)
+{
+    long long max = NUM_DIRECT;
+    long long span = 1;
+    int levels;
+
+    //runs have no fixed number of slots, only num_blocks limits them
+    if(fs_features & FORMAT_EXTENTS)
+        return INT_MAX;
+
+    for(levels = 1; levels <= MAP_LEVELS; levels++)
+    {
+        span *= PTRS_PER_BLOCK;
+        max += span;
+    }
+
+    return max > INT_MAX ? INT_MAX : max;
+}
+
+//finds the indirection tree holding file block file_block_num, returns its depth (0 for a direct
+//block, -1 past the end), idx gets the index within the tree and span how many blocks it covers
+int map_locate(int file_block_num, int *idx, long long *span)
+{
+    int levels;
+
+    *idx = file_block_num - NUM_DIRECT;
+    *span = 1;
+
+    if(file_block_num < 0)
+        return -1;
+
+    if(*idx < 0)
+        return 0;
+
+    for(levels = 1; levels <= MAP_LEVELS; levels++)
+    {
+        *span *= PTRS_PER_BLOCK;
+
+        if(*idx < *span)
+            return levels;
+
+        *idx -= *span;
+    }
+
+    return -1;
+}
+
+//first block_map slot of the tree that is levels deep
+#define MAP_SLOT(levels) ((levels) * ((levels) - 1) / 2)
+
+//makes map slot s a copy of disk block block_num unless it already is one, writing back what it held
+int map_load(struct block_map *map, int s, BLOCK block_num)
+{
+    if(map->blk[s] != NULL && map->num[s] == block_num)
+        return 0;
+
+    if(map->blk[s] == NULL && (map->blk[s] = malloc(BLOCK_SIZE)) == NULL)
+        return -1;
+
+    if(map->dirty[s] && !write_block(file, map->blk[s], map->num[s]))
+    {
+        DEBUG2 && printf("error writing indirection block\n");
+        return -1;
+    }
+
+    map->dirty[s] = 0;
+
+    if(!read_block(file, map->blk[s], block_num))
+    {
+        DEBUG2 && printf("error reading indirection block\n");
+        map->num[s] = 0;
+        return -1;
+    }
+
+    map->num[s] = block_num;
+
+    return 0;
+}
+
+int bmap_cached(struct block_map *map, struct inode *inode, int file_block_num)
+{
+    BLOCK block_num;
+    long long span;
+    int levels, idx, l;
+
+    if(!inode)
+    {
+        DEBUG2 && printf("inode is null\n");
+        return -1;
+    }
+
+    if(map == NULL)
+        return bmap(inode, file_block_num);
+
+    //inline data has no block to map
+    if(IS_INLINE(inode))
+        return -1;
+
+    if(fs_features & FORMAT_EXTENTS)
+        return extent_map(map, inode, file_block_num, NULL);
+
+    if((levels = map_locate(file_block_num, &idx, &span)) < 0)
+    {
+        DEBUG2 && printf("Error: block number out of range\n");
+        return -1;
+    }
+
+    if(levels == 0)
+    {
+        return inode->file_blocks[file_block_num];
+    }
+
+    block_num = *inode_root(inode, levels);
+
+    for(l = 0; l < levels; l++)
+    {
+        span /= PTRS_PER_BLOCK;
+
+        if(map_load(map, MAP_SLOT(levels) + l, block_num))
+            return -1;
+
+        block_num = map->blk[MAP_SLOT(levels) + l]->pointer[(idx / span) % PTRS_PER_BLOCK];
+    }
+
+    return block_num;
+}
+
+int bmap_set(struct block_map *map, struct inode *inode, int file_block_num, BLOCK block)
+{
+    BLOCK *ptr;
+    long long span;
+    int levels, idx, l, s, new_num;
+
+    if(fs_features & FORMAT_EXTENTS)
+        return extent_append(map, inode, file_block_num, block);
+
+    if((levels = map_locate(file_block_num, &idx, &span)) < 0)
+        return -1;
+
+    if(levels == 0)
+    {
+        inode->file_blocks[file_block_num] = block;
+        return 0;
+    }
+
+    ptr = inode_root(inode, levels);
+
+    for(l = 0; l < levels; l++)
+    {
+        s = MAP_SLOT(levels) + l;
+
+        //the first block an indirection block covers brings in a new one
+        if(idx % span == 0)
+        {
+            if((new_num = get_free_datablock()) < 0)
+                return -1;
+
+            if(map->blk[s] == NULL && (map->blk[s] = malloc(BLOCK_SIZE)) == NULL)
+                return -1;
+
+            if(map->dirty[s] && !write_block(file, map->blk[s], map->num[s]))
+                return -1;
+
+            memset(map->blk[s], 0, BLOCK_SIZE);
+            map->num[s] = new_num;
+            map->dirty[s] = 1;
+            *ptr = new_num;
+
+            if(l > 0)
+                map->dirty[s-1] = 1;
+        }
+        else if(map_load(map, s, *ptr))
+        {
+            return -1;
+        }
+
+        span /= PTRS_PER_BLOCK;
+        ptr = &map->blk[s]->pointer[(idx / span) % PTRS_PER_BLOCK];
+    }
+
+    *ptr = block;
+    map->dirty[MAP_SLOT(levels) + levels - 1] = 1;
+
+    return 0;
+}
+
+int bmap_flush(struct block_map *map)
+{
+    int s, ret = 0;
+
+    for(s = 0; s < MAP_SLOTS; s++)
+    {
+        if(map->dirty[s])
+        {
+            if(!write_block(file, map->blk[s], map->num[s]))
+                ret = -1;
+            map->dirty[s] = 0;
+        }
+    }
+
+    return ret;
+}
+
+void bmap_invalidate(int inode_num)
+{
+    int i, s;
+
+    for(i = 0; i < MAX_OPEN_FILES; i++)
+    {
+        if(open_file_table[i].currently_opened && open_file_table[i].inode_number == inode_num)
+        {
+            for(s = 0; s < MAP_SLOTS; s++)
+            {
+                open_file_table[i].map.num[s] = 0;
+            }
+        }
+    }
+
+    //a directory being read can have its blocks moved the same way
+    for(i = 0; i < MAX_OPEN_DIRS; i++)
+    {
+        if(open_dir_table[i].currently_opened && open_dir_table[i].inode_number == inode_num)
+        {
+            for(s = 0; s < MAP_SLOTS; s++)
+            {
+                open_dir_table[i].map.num[s] = 0;
+            }
+        }
+    }
+}
+
+void bmap_release(struct block_map *map)
+{
+    int s;
+
+    for(s = 0; s < MAP_SLOTS; s++)
+    {
+        free(map->blk[s]);
+    }
+
+    memset(map, 0, sizeof(struct block_map));
+}
+
+int free_indirection_tree(BLOCK block_num, int levels)
+{
+    struct indirection_block *iblock;
+    int i;
+
+    if(block_num == 0)
+        return 0;
+
+    //the bottom level points at data blocks, those are freed by whoever owns them
+    if(levels > 1)
+    {
+        iblock = malloc(BLOCK_SIZE);
+
+        if(!read_block(file, iblock, block_num))
+        {
+            free(iblock);
+            return -1;
+        }
+
+        for(i = 0; i < PTRS_PER_BLOCK; i++)
+        {
+            if(iblock->pointer[i] != 0)
+                free_indirection_tree(iblock->pointer[i], levels - 1);
+        }
+
+        free(iblock);
+    }
+
+    return make_free_datablock(block_num);
+}
+
+//the node at level l of the right edge loaded into map, level 0 is the root in the inode
+#define EXTENT_NODE(map, inode, l) \
+    ((l) == 0 ? (struct extent_block *)&(inode)->extents : (struct extent_block *)(map)->blk[(l) - 1])
+#define EXTENT_CAP(l) ((l) == 0 ? ROOT_EXTENTS : EXTENTS_PER_BLOCK)
+
+//last entry of node starting at or before file_block_num, -1 if there is none
+int extent_search(struct extent_block *node, int file_block_num)
+{
+    int lo = 0, hi = node->entries - 1, mid;
+
+    if(hi < 0 || node->ext[0].file_block > file_block_num)
+        return -1;
+
+    //appends and sequential reads land in the last run, check it first
+    if(node->ext[hi].file_block <= file_block_num)
+        return hi;
+
+    while(lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
+
+        if(node->ext[mid].file_block <= file_block_num)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return lo;
+}
+
+int extent_map(struct block_map *map, struct inode *inode, int file_block_num, int *left)
+{
+    struct extent_block *node = EXTENT_NODE(map, inode, 0);
+    struct extent *ext;
+    int l, i;
+
+    for(l = 0; ; l++)
+    {
+        if((i = extent_search(node, file_block_num)) < 0)
+            return -1;
+
+        if(node->depth == 0)
+            break;
+
+        if(l >= MAP_SLOTS || map_load(map, l, node->ext[i].start))
+            return -1;
+
+        node = EXTENT_NODE(map, inode, l + 1);
+    }
+
+    ext = &node->ext[i];
+
+    if(file_block_num >= ext->file_block + ext->len)
+        return -1;
+
+    if(left != NULL)
+        *left = ext->file_block + ext->len - file_block_num;
+
+    return ext->start + (file_block_num - ext->file_block);
+}
+
+//loads the nodes along the right edge of the tree into map, returns the depth
+int extent_edge(struct block_map *map, struct inode *inode)
+{
+    struct extent_block *node;
+    int l;
+
+    for(l = 0; (node = EXTENT_NODE(map, inode, l))->depth > 0; l++)
+    {
+        if(l >= MAP_SLOTS || node->entries == 0 || map_load(map, l, node->ext[node->entries - 1].start))
+            return -1;
+    }
+
+    return l;
+}
+
+//moves the root's entries into a new block one level down, leaving room at the top
+int extent_push_down(struct block_map *map, struct inode *inode)
+{
+    struct extent_root *root = &inode->extents;
+    int new_num;
+
+    if(root->depth >= MAP_SLOTS || (new_num = get_free_datablock()) < 0)
+        return -1;
+
+    //every node moves one level down and so do their copies in the map
+    if(map->dirty[MAP_SLOTS - 1] && !write_block(file, map->blk[MAP_SLOTS - 1], map->num[MAP_SLOTS - 1]))
+        return -1;
+
+    free(map->blk[MAP_SLOTS - 1]);
+    memmove(&map->num[1], &map->num[0], (MAP_SLOTS - 1) * sizeof(BLOCK));
+    memmove(&map->dirty[1], &map->dirty[0], (MAP_SLOTS - 1) * sizeof(int));
+    memmove(&map->blk[1], &map->blk[0], (MAP_SLOTS - 1) * sizeof(struct indirection_block *));
+
+    if((map->blk[0] = malloc(BLOCK_SIZE)) == NULL)
+        return -1;
+
+    memset(map->blk[0], 0, BLOCK_SIZE);
+    memcpy(map->blk[0], root, sizeof(struct extent_root));
+    map->num[0] = new_num;
+    map->dirty[0] = 1;
+
+    root->entries = 1;
+    root->depth++;
+    root->ext[0].start = new_num;
+    root->ext[0].len = 0;
+
+    return 0;
+}
+
+int extent_append(struct block_map *map, struct inode *inode, int file_block_num, BLOCK block)
+{
+    struct extent_block *node;
+    struct extent *last;
+    int depth, l, k, new_num;
+
+    if((depth = extent_edge(map, inode)) < 0)
+        return -1;
+
+    node = EXTENT_NODE(map, inode, depth);
+    last = node->entries > 0 ? &node->ext[node->entries - 1] : NULL;
+
+    //sequential writes mostly just make the last run longer
+    if(last != NULL && last->file_block + last->len == file_block_num && last->start + last->len == block)
+    {
+        last->len++;
+
+        if(depth > 0)
+            map->dirty[depth - 1] = 1;
+
+        return 0;
+    }
+
+    //the lowest node on the right edge with room takes a new chain of nodes down to a new leaf
+    for(l = depth; l >= 0 && EXTENT_NODE(map, inode, l)->entries >= EXTENT_CAP(l); l--)
+        ;
+
+    if(l < 0)
+    {
+        if(extent_push_down(map, inode))
+            return -1;
+
+        depth++;
+        l = 1;
+    }
+
+    for(k = l; k < depth; k++)
+    {
+        if((new_num = get_free_datablock()) < 0)
+            return -1;
+
+        node = EXTENT_NODE(map, inode, k);
+        node->ext[node->entries].file_block = file_block_num;
+        node->ext[node->entries].start = new_num;
+        node->ext[node->entries].len = 0;
+        node->entries++;
+
+        if(k > 0)
+            map->dirty[k - 1] = 1;
+
+        if(map->dirty[k] && !write_block(file, map->blk[k], map->num[k]))
+            return -1;
+
+        memset(map->blk[k], 0, BLOCK_SIZE);
+        ((struct extent_block *)map->blk[k])->depth = depth - k - 1;
+        map->num[k] = new_num;
+        map->dirty[k] = 1;
+    }
+
+    node = EXTENT_NODE(map, inode, depth);
+    node->ext[node->entries].file_block = file_block_num;
+    node->ext[node->entries].start = block;
+    node->ext[node->entries].len = 1;
+    node->entries++;
+
+    if(depth > 0)
+        map->dirty[depth - 1] = 1;
+
+    return 0;
+}
+
+int extent_trim(struct inode *inode, int inode_num)
+{
+    struct block_map map;
+    struct extent_block *node;
+    struct extent *last;
+    int depth, l;
+    int trimmed = 0;
+
+    bmap_invalidate(inode_num);
+    memset(&map, 0, sizeof(struct block_map));
+
+    //shorten the last run until nothing is mapped past the end of the file
+    while((depth = extent_edge(&map, inode)) >= 0)
+    {
+        node = EXTENT_NODE(&map, inode, depth);
+
+        if(node->entries == 0)
+            break;
+
+        last = &node->ext[node->entries - 1];
+
+        if(last->file_block + last->len <= inode->num_blocks)
+            break;
+
+        trimmed = 1;
+        last->len = inode->num_blocks > last->file_block ? inode->num_blocks - last->file_block : 0;
+
+        if(depth > 0)
+            map.dirty[depth - 1] = 1;
+
+        if(last->len > 0)
+            continue;
+
+        //an empty run goes, and so does every node it leaves empty on the way up
+        node->entries--;
+
+        for(l = depth; l > 0 && EXTENT_NODE(&map, inode, l)->entries == 0; l--)
+        {
+            make_free_datablock(map.num[l - 1]);
+            map.dirty[l - 1] = 0;
+            map.num[l - 1] = 0;
+            EXTENT_NODE(&map, inode, l - 1)->entries--;
+
+            if(l > 1)
+                map.dirty[l - 2] = 1;
+        }
+
+        if(inode->extents.entries == 0)
+            inode->extents.depth = 0;
+    }
+
+    if(depth < 0 || bmap_flush(&map))
+        trimmed = -1;
+
+    bmap_release(&map);
+
+    if(trimmed)
+        mark_inode_dirty(inode_num);
+
+    return trimmed;
+}
+
+int extent_free(struct extent_block *node)
+{
+    struct extent_block *child;
+    int i, b;
+
+    for(i = 0; i < node->entries; i++)
+    {
+        if(node->depth == 0)
+        {
+            for(b = 0; b < node->ext[i].len; b++)
+            {
+                make_free_datablock(node->ext[i].start + b);
+            }
+            continue;
+        }
+
+        child = malloc(BLOCK_SIZE);
+
+        if(!read_block(file, child, node->ext[i].start))
+        {
+            DEBUG2 && printf("error reading extent block\n");
+            free(child);
+            return -1;
+        }
+
+        extent_free(child);
+        free(child);
+        make_free_datablock(node->ext[i].start);
+    }
+
+    return 0;
+}
+
+int bmap_run(struct block_map *map, struct inode *inode, int file_block_num, int max, int *first)
+{
+    int run = 1;
+
+    if(fs_features & FORMAT_EXTENTS)
+    {
+        //one lookup maps the rest of the run
+        if(max <= 0 || (*first = extent_map(map, inode, file_block_num, &run)) < 0)
+            return 0;
+
+        return run < max ? run : max;
+    }
+
+    if(max <= 0 || (*first = bmap_cached(map, inode, file_block_num)) < 0)
+        return 0;
+
+    while(run < max && bmap_cached(map, inode, file_block_num + run) == *first + run)
+    {
+        run++;
+    }
+
+    return run;
+}
+
+int get_data_block(struct datablock **dblk, struct inode *inode, int file_block_num)
+{
+    return get_mapped_block(NULL, dblk, inode, file_block_num);
+}
+
+int get_mapped_block(struct block_map *map, struct datablock **dblk, struct inode *inode, int file_block_num)
+{
+    struct datablock *dblock;
+    int block_num;
+
+    *dblk = NULL;
+
+    if((block_num = bmap_cached(map, inode, file_block_num)) < 0)
+    {
+        return -1;
+    }
+
+    dblock = malloc(BLOCK_SIZE);
+
+    if(!read_block(file, dblock, block_num))
+    {
+        DEBUG2 && printf("error reading datablock\n");
+        free(dblock);
+        return -1;
+    }
+
+    *dblk = dblock;
+
+    return block_num;
+}
+
+int has_file(struct inode *cur_inode, char *cur)
+{
+    //this assumes cur_inode is dir and looks for something named cur
+    int i,k,end;
+
+    struct directory *cur_directory_block = NULL;// = malloc(BLOCK_SIZE);
+    struct datablock *datablock = NULL;
+
+    if(cur_inode == NULL)
+    {
+        DEBUG1 && printf("cur_inode is null \n");
+        return -1;
+    }
+
+    if(cur_inode->is_dir == 0)
+    {
+        return -2; //cur_inode not dir
+    }
+
+    //a hashed directory only has to look in one block
+    if(cur_inode->is_dir == DIR_HASHED)
+    {
+        if((i = dir_bucket(cur_inode, cur)) < 0)
+            return -2;
+        end = i + 1;
+    }
+    else
+    {
+        i = 0;
+        end = cur_inode->num_blocks;
+    }
+
+    for(; i < end; i++)
+    {
+        //when the disk is mapped, scan the directory in place instead of copying it out
+        if((cur_directory_block = map_block(bmap(cur_inode, i))) == NULL)
+        {
+            free(datablock);
+            get_data_block(&datablock, cur_inode, i);
+            cur_directory_block = (struct directory *)datablock;
+        }
+
+        if( ! (cur_directory_block) )
+        {
+            DEBUG2 && printf("error reading dir block\n");
+            return -2;
+        }
+
+        for(k=0 ; k < DIRENTS_PER_BLOCK ; k++)
+        {
+            int cur_inum = cur_directory_block->entries[k].inode_number;
+            char *cur_iname = cur_directory_block->entries[k].filename;
+
+            //printf("has_file: cur_inum %d\n",cur_inum);
+            //printf("has_file: cur_iname %s %d\n", cur_iname, strlen(cur_iname));
+            //printf("has_file: cur %s %d\n", cur, strlen(cur));
+            if(cur_inum < 0)
+            {
+                free(datablock);
+                return -2;//invalid inode
+            }
+
+            if(strcmp(cur, cur_iname) == 0)
+            {
+                //printf("has_file: match\n");
+                free(datablock);
+                return cur_inum;
+            }
+
+        }
+    }
+
+    free(datablock);
+    return -1; //not found
+}
+
+int hack_funct()
+{
+    struct inode *inode = NULL;
+    struct directory *new_d = malloc(BLOCK_SIZE);
+
+    int i, j;
+
+    get_inode(&inode, 1);
+
+    inode->next_free_inode = -1;
+    inode->is_free = 0;
+    inode->is_dir = 1;
+    inode->num_blocks = 1;
+    inode->file_blocks[0] = 4;
+
+    mark_inode_dirty(1);
+    release_inode(1);
+
+    for (i=0; i<DIRENTS_PER_BLOCK; i++)
+    {
+        for (j=0; j<12; j++)
+        {
+            new_d->entries[i].filename[j] = 0;
+        }
+
+        new_d->entries[i].inode_number = 0;
+    }
+
+
+    new_d->entries[0].filename[0] = 'c';
+    new_d->entries[0].filename[1] = 'w';
+    new_d->entries[0].filename[2] = 'i';
+    new_d->entries[0].filename[3] = 'l';
+    new_d->entries[0].filename[4] = 'l';
+    new_d->entries[0].filename[5] = 's';
+    new_d->entries[0].filename[6] = '\0';
+
+    new_d->entries[0].inode_number = 2;
+
+    write_block(file, new_d, 4);
+
+    free(new_d);
+    //printf("endofhack\n");
+}
+
+int create_file(int base, char *path, int is_dir)
+{
+    char *lpath = malloc(sizeof(char)*strlen(path)+1);
+    char *last;
+    char *ptr;
+    int wd, free_inode_num, found, s;
+
+    struct inode *cur_inode = NULL;
+
+    strcpy(lpath, path);
+
+    if(strcmp(lpath, "/") == 0)
+    {
+        return ERR_FILE_EXISTS;
+    }
+
+    ptr = strrchr(lpath, '/');
+
+
+    if(ptr != NULL && ptr == lpath+strlen(lpath)-1)
+    {
+        *ptr = '\0';
+        ptr = strrchr(lpath, '/');
+    }
+
+    if(ptr == NULL)
+    {
+        //a bare name goes in the starting directory itself
+        last = malloc(sizeof(char)*strlen(lpath)+1);
+        strcpy(last, lpath);
+        lpath[0] = '\0';
+    }
+    else
+    {
+        *ptr = '\0';
+        ptr++;
+
+        last = malloc(sizeof(char)*strlen(ptr)+1);
+
+        strcpy(last, ptr);
+    }
+
+    if(last[0] == '\0')
+    {
+        return ERR_INVALID_PATH;
+    }
+
+    //lpath lost its leading / if the parent is the root
+    wd = path_to_inode_from(path[0] == '/' ? 0 : base, lpath);
+
+    DEBUG1 &&  printf("wd = %d \n", wd);
+
+    if(wd < 0)
+    {
+        return ERR_INVALID_PATH;
+    }
+    //printf("wd inode = %d \n", wd);
+
+    if(get_inode(&cur_inode, wd))
+    {
+        DEBUG2 && 	printf("get inode failed\n");
+        return ERR_INTERNAL;
+    }
+
+    found = has_file(cur_inode, last);
+    release_inode(wd);
+    //printf("found = %d \n", found);
+    DEBUG1 && printf("found = %d \n", found);
+
+    if(found != -1)
+    {
+        //printf("file or dir already exists!\n");
+        //printf("wd = %d, last = %s \n ", wd, last);
+        return ERR_FILE_EXISTS;
+    }
+
+    free_inode_num = get_free_inode();
+    //printf("free inode num = %d\n", free_inode_num);
+
+    if(free_inode_num < 0)
+    {
+        return ERR_MAX_FILES;
+    }
+
+    if(get_inode(&cur_inode, free_inode_num))
+    {
+        return ERR_INTERNAL;
+    }
+
+    cur_inode->is_dir = is_dir;
+
+    mark_inode_dirty(free_inode_num);
+    release_inode(free_inode_num);
+
+    //free_data_block_num = get_free_datablock();
+    //printf("free_data_block_num = %d\n", free_data_block_num);
+
+    s = add_dir_to_inode(wd, last, free_inode_num);
+
+    return s;
+}
+
+int path_to_inode(char *orig_path)
+{
+    return path_to_inode_from(0, orig_path);
+}
+
+int path_to_inode_from(int base, char *orig_path)
+{
+    char *cur;
+    struct inode *cur_inode = NULL;
+    char *path;
+    path = malloc(sizeof(char)*strlen(orig_path)+1);
+    strcpy(path, orig_path);
+
+    pwd = orig_path[0] == '/' ? 0 : base; //absolute paths start at root
+
+    //printf("path = %s\n");
+    //if(strcmp(path, "/") == 0)
+    //return 0;
+
+    for(cur = strtok(path, "/"); cur != NULL; cur = strtok(NULL, "/"))
+    {
+        int prev_wd = pwd;
+
+        DEBUG1 && printf("%s \n",cur);
+
+        //a remembered lookup does not need the directory at all
+        if(!dcache_lookup(prev_wd, cur, &pwd))
+        {
+            if(get_inode(&cur_inode, prev_wd))
+            {
+                DEBUG2 && printf("ERROR: couldn't get free inode \n ");
+                free(path);
+                return -1;
+            }
+
+            pwd = has_file(cur_inode, cur);
+            release_inode(prev_wd);
+
+            //found or known missing, -2 (not a directory, read errors) is not remembered
+            if(pwd >= -1)
+                dcache_set(prev_wd, cur, pwd);
+        }
+
+        DEBUG1 && printf("pwd = %d\n", pwd);
+
+        if(pwd == -1)
+        {
+            DEBUG2 && printf("not found or not valid inode\n");
+            //pwd = prev_wd;
+            pwd = -1;
+            break;
+        }
+
+        if(pwd == -2)
+        {
+            DEBUG1 && printf("not a dir\n");
+            //pwd = prev_wd;
+            pwd = -1;
+            break;
+        }
+
+    }
+    free(path);
+    return pwd;
+}
+
+int file_open(char *pathOf)
+{
+    return file_open_from(0, pathOf);
+}
+
+int file_open_from(int base, char *pathOf)
+{
+    struct inode *inode = NULL;
+    int i;
+    int inum = path_to_inode_from(base, pathOf);
+
+    // Check if the file exists. If not then error out
+    if (inum == -1)
+    {
+        DEBUG2 && printf("File not found\n");
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    //the open file table entry keeps holding the inode in the cache until file_close
+    if (get_inode(&inode, inum))
+    {
+        return ERR_INTERNAL;
+    }
+
+    if (inode->is_dir != 0)
+    {
+        DEBUG2 && printf("The file is a directory\n");
+        release_inode(inum);
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    DEBUG1 && printf("File does exist, is not a directory and is in inode number %d\n", inum);
+
+    //allowing multiple opens of the same file so we need not check if a file is already opened
+    //we just add whatever file we get whether its been opened alread or not
+    /*
+    for (i = 0; i < 20; i++) {
+    	if (open_file_table[i].currently_opened == 1 && open_file_table[i].inode_number == inum){
+    		printf("File already opened\n");
+    		return ERR_FILE_ALREADY_OPEN;
+    	}
+    }
+    */
+
+    DEBUG1 && printf("Adding to open file table\n");
+
+    // If file exists and is not open, then add an entry to the open file table
+
+    for (i = 0; i < 20; i++)
+    {
+        if (open_file_table[i].currently_opened == 0)
+        {
+            open_file_table[i].inode_number = inum;
+            open_file_table[i].currently_opened = 1;
+            open_file_table[i].seek_position = 0;
+            open_file_table[i].inode = inode;
+            memset(&open_file_table[i].map, 0, sizeof(struct block_map));
+            open_file_table[i].wbuf = NULL;
+            open_file_table[i].wb_size = 0;
+            open_file_table[i].wb_len = 0;
+            open_file_table[i].ra_next = 0;
+            open_file_table[i].ra_window = 0;
+            open_file_table[i].ra_end = 0;
+            DEBUG1 && printf("File added to open file table\n");
+            return i; //this is the index in the table were we put inode
+        }
+    }
+
+    DEBUG1 && printf("Maximum files opened. Cannot open file\n");
+    release_inode(inum);
+    return ERR_TOO_MANY_FILES_OPEN;
+}
+
+int file_close(int file_number)
+{
+    int ret = SUCCESS;
+
+    //all we have to do is remove it from the table if its there
+    if(open_file_table[file_number].currently_opened == 0)
+    {
+        DEBUG1 && printf("file with descriptor %d is not currently open. \n", file_number);
+        return ERR_FILE_NOT_OPEN;
+    }
+    else
+    {
+        //the handle goes away either way, a failed write back is reported
+        io_batch_begin();
+
+        if(wb_flush(&open_file_table[file_number]))
+            ret = ERR_INTERNAL;
+
+        ret = io_batch_end(ret);
+
+        free(open_file_table[file_number].wbuf);
+        open_file_table[file_number].wbuf = NULL;
+        open_file_table[file_number].wb_len = 0;
+        open_file_table[file_number].currently_opened = 0;
+        bmap_release(&open_file_table[file_number].map);
+        release_inode(open_file_table[file_number].inode_number);
+        return ret;
+    }
+
+
+    /*
+    struct inode_block *inode_block = NULL;
+    struct inode *inode = NULL;
+    int inum = path_to_inode(pathOf);
+
+    get_inode(&inode_block, &inode, inum);
+
+    // Check if the file exists. If not then error out
+    if (inum == -1)
+    {
+    	printf("File not found\n");
+    	return ERR_FILE_NOT_FOUND;
+    }
+
+    if (inode->is_dir == 1)
+    {
+    	printf("The file is a directory\n");
+    	return -2;
+    }
+
+    printf("File does exist, is not a directory and is in inode number %d\n", inum);
+
+    int i;
+
+    // Check if file is already opened. If yes the close it
+    for (i = 0; i < 20; i++)
     {
     	if (open_file_table[i].inode_number == inum){
     		open_file_table[i].currently_opened = 0;
@@ -1109,196 +4474,797 @@ void file_close(int file_number)
     */
 }
 
+void set_write_buffer_size(int bytes)
+{
+    if(bytes < 0)
+        bytes = 0;
+
+    write_buffer_size = bytes;
+}
+
+int wb_write(struct open_file_table_entry *entry, void *buffer, int bytes)
+{
+    struct inode *inode = entry->inode;
+    BYTE *bbuffer = (BYTE *)buffer;
+    long long spos = entry->seek_position;
+    long long pos, window_end;
+    int size, done, n;
+
+    //inline files are written in the inode anyway, and so are empty files that may become one
+    if(write_buffer_size <= 0 || bytes <= 0 || IS_INLINE(inode) ||
+       ((fs_features & FORMAT_INLINE) && inode->num_blocks == 0))
+        return 0;
+
+    size = entry->wb_size;
+
+    if(entry->wbuf == NULL)
+    {
+        size = (write_buffer_size + BLOCK_SIZE-1) / BLOCK_SIZE * BLOCK_SIZE;
+
+        if(bytes >= size || (entry->wbuf = alloc_block_buffer(size)) == NULL)
+            return 0;
+
+        entry->wb_size = size;
+        entry->wb_len = 0;
+    }
+
+    if(bytes >= size)
+        return 0;
+
+    //the blocks are allocated now so running out of space shows up in this call, not the flush
+    if(spos + bytes > (long long)BLOCK_SIZE * inode->num_blocks)
+    {
+        add_data_blocks_for(entry->inode_number, (spos + bytes - (long long)BLOCK_SIZE*inode->num_blocks + BLOCK_SIZE-1) / BLOCK_SIZE,
+                            NULL, spos, spos + bytes);
+
+        if(spos + bytes > (long long)BLOCK_SIZE * inode->num_blocks)
+            return 0;
+    }
+
+    //the buffer holds one contiguous run inside a size aligned window of the file,
+    //a write somewhere else or one filling the window to its end writes it out
+    for(done = 0; done < bytes; done += n)
+    {
+        pos = spos + done;
+
+        if(entry->wb_len > 0 && pos != entry->wb_pos + entry->wb_len && wb_flush(entry))
+            return ERR_INTERNAL;
+
+        if(entry->wb_len == 0)
+            entry->wb_pos = pos;
+
+        window_end = (entry->wb_pos / size + 1) * size;
+        n = bytes - done;
+
+        if(n > window_end - pos)
+            n = window_end - pos;
+
+        memcpy(entry->wbuf + (pos - entry->wb_pos), bbuffer + done, n);
+        entry->wb_len += n;
+
+        if(entry->wb_pos + entry->wb_len == window_end && wb_flush(entry))
+            return ERR_INTERNAL;
+    }
+
+    return bytes;
+}
+
+int wb_flush(struct open_file_table_entry *entry)
+{
+    int len = entry->wb_len;
+
+    if(len == 0)
+        return 0;
+
+    entry->wb_len = 0;
+
+    if(write_at(entry, entry->wb_pos, entry->wbuf, len) != len)
+    {
+        DEBUG2 && printf("error writing back the write buffer\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int wb_flush_inode(int inode_num)
+{
+    int i, ret = 0;
+
+    for(i = 0; i < MAX_OPEN_FILES; i++)
+    {
+        if(open_file_table[i].currently_opened && open_file_table[i].inode_number == inode_num &&
+           wb_flush(&open_file_table[i]))
+            ret = -1;
+    }
+
+    return ret;
+}
+
+int wb_flush_all(void)
+{
+    int i, ret = 0;
+
+    for(i = 0; i < MAX_OPEN_FILES; i++)
+    {
+        if(open_file_table[i].currently_opened && wb_flush(&open_file_table[i]))
+            ret = -1;
+    }
+
+    return ret;
+}
+
+void wb_discard(int inode_num)
+{
+    int i;
+
+    for(i = 0; i < MAX_OPEN_FILES; i++)
+    {
+        if(open_file_table[i].currently_opened && open_file_table[i].inode_number == inode_num)
+            open_file_table[i].wb_len = 0;
+    }
+}
+
 int file_write(int file_number, void *buffer, int bytes)
 {
-    struct inode_block *inode_block = NULL;
-    struct inode *inode = NULL;
-    struct datablock *datablock = NULL;
-    int copened, inum, spos;
-    int file_size; //in bytes
-    int pos, bnum, bidx;
+    struct open_file_table_entry *entry = &open_file_table[file_number];
+    int bytes_w, i;
+
+    if(entry->currently_opened == 0)
+    {
+        DEBUG1 && printf("file desc %d is not opened \n", file_number);
+        return ERR_FILE_NOT_OPEN;
+    }
+    if(entry->inode_number <= 0)
+    {
+        DEBUG2 && printf("invalid inode \n");
+        return ERR_INTERNAL;
+    }
+
+    io_batch_begin();
+
+    //bytes still buffered by other handles on the file would land on top of this write later
+    for(i = 0; i < MAX_OPEN_FILES; i++)
+    {
+        if(i != file_number && open_file_table[i].currently_opened && open_file_table[i].wb_len > 0 &&
+           open_file_table[i].inode_number == entry->inode_number && wb_flush(&open_file_table[i]))
+            return io_batch_end(ERR_INTERNAL);
+    }
+
+    //small writes are gathered in the handle's write buffer, anything else goes straight through
+    if((bytes_w = wb_write(entry, buffer, bytes)) == 0)
+    {
+        if(wb_flush(entry))
+            return io_batch_end(ERR_INTERNAL);
+
+        bytes_w = write_at(entry, entry->seek_position, buffer, bytes);
+    }
+
+    if(bytes_w > 0)
+        entry->seek_position += bytes_w;
+
+    return io_batch_end(bytes_w);
+}
+
+int write_at(struct open_file_table_entry *entry, long long spos, void *buffer, int bytes)
+{
+    struct inode *inode = entry->inode;
+    struct block_map *map = &entry->map;
+    int inum = entry->inode_number;
+    long long pos;
+    long long file_size; //in bytes
+    int bnum, bidx;
     int new_db = 0;
     int bytes_w =0;
     BYTE *bbuffer = (BYTE *)buffer;
     int cur_blk_num;
+    int span;
 
-    copened = open_file_table[file_number].currently_opened;
-    inum = open_file_table[file_number].inode_number;
-    spos = open_file_table[file_number].seek_position;
+    //small files start out inline and move to a block once written past INLINE_SIZE
+    if((fs_features & FORMAT_INLINE) && !inode->is_dir && bytes > 0)
+    {
+        if(inode->num_blocks == 0 && spos + bytes <= INLINE_SIZE)
+        {
+            inode->num_blocks = 1;
+        }
+
+        if(IS_INLINE(inode))
+        {
+            if(spos + bytes <= INLINE_SIZE)
+            {
+                memcpy(inode->inline_data + spos, buffer, bytes);
+                mark_inode_dirty(inum);
+                return bytes;
+            }
+
+            if(inline_to_block(inode, inum))
+                return ERR_DISK_FULL;
+        }
+    }
+
+    file_size = (long long)BLOCK_SIZE * inode->num_blocks;
+
+    //printf("num_data_blocks = %d \n", inode->num_blocks);
+    //printf("file_size = %d \n", file_size);
+
+    if((file_size - spos) < bytes)
+    {
+        //grow the file in one batch, if we can't get all of it we write what we can
+        new_db = (spos + bytes - file_size + BLOCK_SIZE-1) / BLOCK_SIZE;
+        add_data_blocks_for(inum, new_db, NULL, spos, spos + bytes);
+    }
+
+    //printf("num_data_blocks = %d \n", inode->num_blocks);
+
+    bnum = spos / BLOCK_SIZE;
+    bidx = spos % BLOCK_SIZE;
+    //printf("bum %d, bidx %d \n",bnum, bidx);
+
+    //printf("starting byte = %d\n", datablock->byte[bidx]);
+
+    int i = bidx;
+    pos = spos;
+    while(bytes_w < bytes && pos < (long long)inode->num_blocks*BLOCK_SIZE)
+    {
+        if(i == 0 && (bytes - bytes_w) >= BLOCK_SIZE)
+        {
+            //whole blocks are written straight from the caller's buffer,
+            //one write per physically contiguous run
+            int run = (bytes - bytes_w) / BLOCK_SIZE;
+
+            if(run > inode->num_blocks - bnum)
+                run = inode->num_blocks - bnum;
+
+            run = bmap_run(map, inode, bnum, run, &cur_blk_num);
+
+            if(run > 0)
+            {
+                if(write_blocks(file, bbuffer, cur_blk_num, run) != run*BLOCK_SIZE)
+                {
+                    DEBUG2 && printf("error writing datablocks\n");
+                    return ERR_INTERNAL;
+                }
+
+                bbuffer += run*BLOCK_SIZE;
+                bytes_w += run*BLOCK_SIZE;
+                pos += run*BLOCK_SIZE;
+                bnum += run;
+                continue;
+            }
+        }
+
+        //the rest goes in a span at a time, only a partial block needs its old contents
+        span = BLOCK_SIZE - i;
+
+        if(span > bytes - bytes_w)
+            span = bytes - bytes_w;
+
+        if((cur_blk_num = bmap_cached(map, inode, bnum)) < 0)
+        {
+            DEBUG2 && printf("error: datablock is null \n");
+            break;
+        }
+
+        if(span == BLOCK_SIZE)
+        {
+            if(!write_block(file, bbuffer, cur_blk_num))
+            {
+                DEBUG2 && printf("error writing datablock\n");
+                return ERR_INTERNAL;
+            }
+        }
+        else if(copy_block_part(cur_blk_num, i, bbuffer, span, 1) < 0)
+        {
+            DEBUG2 && printf("error writing datablock\n");
+            return ERR_INTERNAL;
+        }
+
+        bbuffer += span;
+        bytes_w += span;
+        pos += span;
+
+        //new_db--;
+        i = 0;
+        bnum++;
+        //cur_blk_num = get_data_block(&datablock, inode, bnum);
+    }
+
+    return bytes_w;
+
+}
+
+void read_ahead(struct open_file_table_entry *entry, long long spos, int bytes)
+{
+    struct inode *inode = entry->inode;
+    int first = spos / BLOCK_SIZE;
+    int last = (spos + bytes - 1) / BLOCK_SIZE;
+    int start, end, run, blk;
+
+    //only a read picking up where the last one stopped counts as sequential, anything
+    //else drops the window so random reads never fetch more than they asked for
+    if(spos != entry->ra_next)
+    {
+        entry->ra_window = 0;
+        entry->ra_end = 0;
+        return;
+    }
+
+    if(last >= inode->num_blocks)
+        last = inode->num_blocks - 1;
+
+    //still well inside what was fetched last time
+    if(last < entry->ra_end - entry->ra_window / 2)
+        return;
+
+    entry->ra_window = entry->ra_window == 0 ? READAHEAD_MIN : entry->ra_window * 2;
+
+    if(entry->ra_window > READAHEAD_MAX)
+        entry->ra_window = READAHEAD_MAX;
+
+    start = entry->ra_end > first ? entry->ra_end : first;
+    end = last + 1 + entry->ra_window;
+
+    if(end > inode->num_blocks)
+        end = inode->num_blocks;
+
+    entry->ra_end = end;
+
+    //the window is mapped a run of consecutive disk blocks at a time and each run read in one go
+    while(start < end && (run = bmap_run(&entry->map, inode, start, end - start, &blk)) > 0)
+    {
+        cache_prefetch(blk, run);
+        start += run;
+    }
+}
+
+int file_read(int file_number, void *buffer, int bytes)
+{
+    struct open_file_table_entry *entry = &open_file_table[file_number];
+    int bytes_r;
+
+    if(entry->currently_opened == 0)
+    {
+        DEBUG1 && printf("file desc %d is not opened \n", file_number);
+        return ERR_FILE_NOT_OPEN;
+    }
+    if(entry->inode_number <= 0)
+    {
+        DEBUG2 && printf("invalid inode \n");
+        return ERR_INTERNAL;
+    }
+
+    io_batch_begin();
+
+    //buffered writes to the file, through this handle or any other, have to be on disk first
+    if(wb_flush_inode(entry->inode_number))
+        return io_batch_end(ERR_INTERNAL);
+
+    bytes_r = read_at(entry, entry->seek_position, buffer, bytes);
+
+    if(bytes_r > 0)
+        entry->seek_position += bytes_r;
+
+    return io_batch_end(bytes_r);
+}
+
+int read_at(struct open_file_table_entry *entry, long long spos, void *buffer, int bytes)
+{
+    struct inode *inode = entry->inode;
+    struct block_map *map = &entry->map;
+    long long file_size; //in bytes
+    int bnum, bidx;
+    int bytes_r=0;
+    BYTE *bbuffer = (BYTE *)buffer;
+    int cur_blk_num;
+    int span;
+
+    file_size = (long long)BLOCK_SIZE * inode->num_blocks;
+
+    //the inline part of the block comes from the inode, the rest of it is zeros
+    if(IS_INLINE(inode))
+    {
+        for(; bytes_r < bytes && spos + bytes_r < file_size; bytes_r++)
+        {
+            bbuffer[bytes_r] = spos + bytes_r < INLINE_SIZE ? inode->inline_data[spos + bytes_r] : 0;
+        }
+
+        return bytes_r;
+    }
+
+    if(bytes > 0 && spos < file_size)
+        read_ahead(entry, spos, bytes);
+
+    //printf("num_data_blocks = %d \n", inode->num_blocks);
+    //printf("file_size = %d \n", file_size);
+
+    bnum = spos / BLOCK_SIZE;
+    bidx = spos % BLOCK_SIZE;
+    //printf("bum %d, bidx %d \n",bnum, bidx);
+
+    //printf("starting byte = %d\n", datablock->byte[bidx]);
+
+    int i = bidx;
+    while(bytes_r < bytes && (file_size - (spos+bytes_r)) > 0)
+    {
+        if(bnum > inode->num_blocks)
+            break;
+
+        if(i == 0 && (bytes - bytes_r) >= BLOCK_SIZE)
+        {
+            //whole blocks are read straight into the caller's buffer,
+            //one read per physically contiguous run
+            int run = (bytes - bytes_r) / BLOCK_SIZE;
+
+            if(run > inode->num_blocks - bnum)
+                run = inode->num_blocks - bnum;
+
+            run = bmap_run(map, inode, bnum, run, &cur_blk_num);
+
+            if(run > 0)
+            {
+                if(read_blocks(file, bbuffer, cur_blk_num, run) != run*BLOCK_SIZE)
+                {
+                    DEBUG2 && printf("error reading datablocks\n");
+                    break;
+                }
+
+                bbuffer += run*BLOCK_SIZE;
+                bytes_r += run*BLOCK_SIZE;
+                bnum += run;
+                continue;
+            }
+        }
+
+        span = BLOCK_SIZE - i;
+
+        if(span > bytes - bytes_r)
+            span = bytes - bytes_r;
+
+        if(span > file_size - (spos+bytes_r))
+            span = file_size - (spos+bytes_r);
+
+        if((cur_blk_num = bmap_cached(map, inode, bnum)) < 0 ||
+           copy_block_part(cur_blk_num, i, bbuffer, span, 0) < 0)
+        {
+            DEBUG2 && printf("error: datablock is null \n");
+            break;
+        }
+
+        bbuffer += span;
+        bytes_r += span;
+
+        //new_db--;
+        i = 0;
+        bnum++;
+        //cur_blk_num = get_data_block(&datablock, inode, bnum);
+    }
+
+    entry->ra_next = spos + bytes_r;
+
+    return bytes_r;
+
+}
 
-    if(copened == 0)
+int file_pread(int file_number, void *buffer, int bytes, long long offset)
+{
+    struct open_file_table_entry *entry = &open_file_table[file_number];
+    struct inode *inode;
+    BYTE *bbuffer = (BYTE *)buffer;
+    BYTE *tmp;
+    int *blks;
+    long long file_size, start;
+    int first, count, k, i, run, blk, slot;
+    int bytes_r = ERR_INTERNAL;
+
+    if(entry->currently_opened == 0)
     {
         DEBUG1 && printf("file desc %d is not opened \n", file_number);
         return ERR_FILE_NOT_OPEN;
     }
-    if(inum <= 0)
+    if(offset < 0)
     {
-        DEBUG2 && printf("invalid inode \n");
+        DEBUG1 && printf("error invalid offset \n");
+        return ERR_INVALID_LSEEK_OFFSET;
+    }
+
+    pthread_mutex_lock(&fs_lock);
+    io_batch_begin();
+
+    if(wb_flush_inode(entry->inode_number))
+    {
+        bytes_r = io_batch_end(ERR_INTERNAL);
+        pthread_mutex_unlock(&fs_lock);
+        return bytes_r;
+    }
+
+    //with the buffered writes submitted nothing newer than the disk is left outside the cache
+    if(io_batch_end(0))
+    {
+        pthread_mutex_unlock(&fs_lock);
         return ERR_INTERNAL;
     }
 
-    get_inode(&inode_block, &inode, inum);
+    inode = entry->inode;
+    file_size = (long long)BLOCK_SIZE * inode->num_blocks;
 
-    file_size = 512 * inode->num_blocks;
+    //inline files live in the inode, nothing to read from disk
+    if(IS_INLINE(inode) || bytes <= 0 || offset >= file_size)
+    {
+        bytes_r = read_at(entry, offset, buffer, bytes);
+        pthread_mutex_unlock(&fs_lock);
+        return bytes_r;
+    }
 
-    //printf("num_data_blocks = %d \n", inode->num_blocks);
-    //printf("file_size = %d \n", file_size);
+    if(offset + bytes > file_size)
+        bytes = file_size - offset;
 
-    while(((512*inode->num_blocks) - spos) < bytes)
+    first = offset / BLOCK_SIZE;
+    count = (offset + bytes - 1) / BLOCK_SIZE - first + 1;
+    blks = malloc(sizeof(int) * count);
+
+    //the mapping and the blocks in the cache are shared, they are only looked at under the
+    //lock. Blocks in the cache get copied now, the rest are read once the lock is dropped
+    for(k = 0; k < count; k += run)
     {
-        int new_db_num;
+        if((run = bmap_run(&entry->map, inode, first + k, count - k, &blk)) <= 0)
+            break;
 
-        new_db_num = add_data_block(inum);
-        get_inode(&inode_block, &inode, inum);
-        if(new_db_num <=0)
+        for(i = 0; i < run; i++)
         {
-            //cannot get anymore blocks!! must be out of space
-            //we will write what we can
-            break;
-        }
+            blks[k + i] = blk + i;
 
-        new_db++;
+            if(cache != NULL && (slot = cache_lookup(blk + i)) != -1)
+            {
+                cache[slot].referenced = 1;
+                pread_piece(bbuffer, offset, bytes, first + k + i, cache[slot].data);
+                blks[k + i] = -1;
+            }
+        }
     }
 
-    //printf("num_data_blocks = %d \n", inode->num_blocks);
+    pthread_mutex_unlock(&fs_lock);
 
-    bnum = spos / 512;
-    bidx = spos % 512;
-    //printf("bum %d, bidx %d \n",bnum, bidx);
+    //a block that couldn't be mapped ends the read there
+    if(k < count)
+    {
+        count = k;
+        bytes = k == 0 ? 0 : (long long)(first + k) * BLOCK_SIZE - offset;
+    }
 
-    //printf("starting byte = %d\n", datablock->byte[bidx]);
+    bytes_r = bytes;
 
-    int i = bidx;
-    pos = spos;
-    while(bytes_w < bytes && pos < inode->num_blocks*512)
+    for(k = 0; k < count; k += run)
     {
-        cur_blk_num = get_data_block(&datablock, inode, bnum);
+        for(run = 1; k + run < count && blks[k + run] != -1 && blks[k + run] == blks[k] + run; run++)
+            ;
 
-        if(datablock == NULL)
+        if(blks[k] == -1)
         {
-            DEBUG2 && printf("error: datablock is null \n");
-            break;
+            run = 1;
+            continue;
         }
 
-        for(i; i < 512; i++)
+        //whole blocks go straight into the caller's buffer, the partial ones at either end through tmp
+        start = (long long)(first + k) * BLOCK_SIZE;
+
+        if(start >= offset && start + (long long)run * BLOCK_SIZE <= offset + bytes)
         {
-            datablock->byte[i] = *bbuffer;
-            bbuffer++;
-            bytes_w++;
-            pos++;
-            if(bytes_w >= bytes || pos >= inode->num_blocks*512)
-            {
+            if(read_blocks_unlocked(file, bbuffer + (start - offset), blks[k], run) != run*BLOCK_SIZE)
                 break;
-            }
+            continue;
         }
-        if( !write_block(file, datablock, cur_blk_num))
+
+        tmp = malloc((size_t)run * BLOCK_SIZE);
+
+        if(read_blocks_unlocked(file, tmp, blks[k], run) != run*BLOCK_SIZE)
         {
-            DEBUG2 && printf("error reading datablock\n");
-            return ERR_INTERNAL;
+            free(tmp);
+            break;
         }
 
-        //new_db--;
-        i = 0;
-        bnum++;
-        //cur_blk_num = get_data_block(&datablock, inode, bnum);
+        for(i = 0; i < run; i++)
+        {
+            pread_piece(bbuffer, offset, bytes, first + k + i, tmp + i * BLOCK_SIZE);
+        }
+
+        free(tmp);
+    }
+
+    //like read_at, a failed read hands back everything before it
+    if(k < count)
+    {
+        DEBUG2 && printf("error reading datablocks\n");
+        bytes_r = k == 0 ? 0 : (long long)(first + k) * BLOCK_SIZE - offset;
+    }
+
+    free(blks);
+
+    return bytes_r;
+}
+
+void pread_piece(BYTE *buffer, long long offset, int bytes, int file_block, const BYTE *data)
+{
+    long long start = (long long)file_block * BLOCK_SIZE;
+    long long from = start > offset ? start : offset;
+    long long to = start + BLOCK_SIZE < offset + bytes ? start + BLOCK_SIZE : offset + bytes;
+
+    if(to > from)
+        memcpy(buffer + (from - offset), data + (from - start), to - from);
+}
+
+int file_pwrite(int file_number, void *buffer, int bytes, long long offset)
+{
+    struct open_file_table_entry *entry = &open_file_table[file_number];
+    int bytes_w = ERR_INTERNAL;
+
+    if(entry->currently_opened == 0)
+    {
+        DEBUG1 && printf("file desc %d is not opened \n", file_number);
+        return ERR_FILE_NOT_OPEN;
+    }
+    if(offset < 0)
+    {
+        DEBUG1 && printf("error invalid offset \n");
+        return ERR_INVALID_LSEEK_OFFSET;
     }
 
-    open_file_table[file_number].seek_position += bytes_w;
+    pthread_mutex_lock(&fs_lock);
+    io_batch_begin();
+
+    //goes straight through, what any handle has buffered is written out first so it cannot land on top later
+    if(wb_flush_inode(entry->inode_number) == 0)
+        bytes_w = write_at(entry, offset, buffer, bytes);
+
+    bytes_w = io_batch_end(bytes_w);
+    pthread_mutex_unlock(&fs_lock);
 
     return bytes_w;
+}
 
+int file_readv(int file_number, const struct iovec *iov, int iovcnt)
+{
+    return file_vec(file_number, iov, iovcnt, 0);
 }
 
-int file_read(int file_number, void *buffer, int bytes)
+int file_writev(int file_number, const struct iovec *iov, int iovcnt)
 {
-    struct inode_block *inode_block = NULL;
-    struct inode *inode = NULL;
-    struct datablock *datablock = NULL;
-    int copened, inum, spos;
-    int file_size; //in bytes
-    int pos, bnum, bidx;
-    int new_db = 0;
-    int bytes_r=0;
-    BYTE *bbuffer = (BYTE *)buffer;
-    int cur_blk_num;
+    return file_vec(file_number, iov, iovcnt, 1);
+}
 
-    copened = open_file_table[file_number].currently_opened;
-    inum = open_file_table[file_number].inode_number;
-    spos = open_file_table[file_number].seek_position;
+int file_vec(int file_number, const struct iovec *iov, int iovcnt, int to_file)
+{
+    long long total = 0;
+    BYTE *stage;
+    int stage_size, chunk, done, n, seg, off, k, len;
+    int ret = 0;
 
-    if(copened == 0)
+    if(open_file_table[file_number].currently_opened == 0)
     {
         DEBUG1 && printf("file desc %d is not opened \n", file_number);
         return ERR_FILE_NOT_OPEN;
     }
-    if(inum <= 0)
+
+    for(k = 0; k < iovcnt; k++)
     {
-        DEBUG2 && printf("invalid inode \n");
-        return ERR_INTERNAL;
+        total += iov[k].iov_len;
     }
 
-    get_inode(&inode_block, &inode, inum);
+    if(total > INT_MAX)
+        total = INT_MAX;
 
-    file_size = 512 * inode->num_blocks;
+    //one buffer needs no staging
+    if(iovcnt == 1)
+        return to_file ? file_write(file_number, iov[0].iov_base, total) : file_read(file_number, iov[0].iov_base, total);
 
-    //printf("num_data_blocks = %d \n", inode->num_blocks);
-    //printf("file_size = %d \n", file_size);
+    if(total == 0)
+        return 0;
 
-    bnum = spos / 512;
-    bidx = spos % 512;
-    //printf("bum %d, bidx %d \n",bnum, bidx);
+    //the buffers are staged a few hundred blocks at a time and each stage goes through a single
+    //file_read or file_write, so every block is looked up and transferred once however the record is cut up
+    stage_size = MAX_IOV_BLOCKS * BLOCK_SIZE;
 
-    //printf("starting byte = %d\n", datablock->byte[bidx]);
+    if(stage_size > total)
+        stage_size = total;
 
-    int i = bidx;
-    while(bytes_r < bytes && (file_size - (spos+bytes_r)) > 0)
+    if((stage = alloc_block_buffer(stage_size)) == NULL)
+        return ERR_INTERNAL;
+
+    seg = 0;
+    off = 0;
+
+    //the stages are all one API call as far as io_uring batching goes
+    io_batch_begin();
+
+    while(ret < total)
     {
-        if(bnum > inode->num_blocks)
-            break;
+        chunk = total - ret;
 
-        cur_blk_num = get_data_block(&datablock, inode, bnum);
+        //after the first stage the stages start on block boundaries
+        if(chunk > stage_size)
+            chunk = stage_size - open_file_table[file_number].seek_position % BLOCK_SIZE;
 
-        if(datablock == NULL)
+        if(to_file)
         {
-            DEBUG2 && printf("error: datablock is null \n");
-            break;
-        }
+            for(done = 0; done < chunk; done += len)
+            {
+                len = iov[seg].iov_len - off;
 
-        for(i; i < 512; i++)
+                if(len > chunk - done)
+                    len = chunk - done;
+
+                memcpy(stage + done, (BYTE *)iov[seg].iov_base + off, len);
+                off += len;
+
+                if(off == iov[seg].iov_len)
+                {
+                    seg++;
+                    off = 0;
+                }
+            }
+
+            n = file_write(file_number, stage, chunk);
+        }
+        else
         {
-            *bbuffer = datablock->byte[i];
-            bbuffer++;
-            bytes_r++;
-            if(bytes_r >= bytes || (file_size - (spos+bytes_r)) < 0 )
+            n = file_read(file_number, stage, chunk);
+
+            for(done = 0; done < n; done += len)
             {
-                break;
+                len = iov[seg].iov_len - off;
+
+                if(len > n - done)
+                    len = n - done;
+
+                memcpy((BYTE *)iov[seg].iov_base + off, stage + done, len);
+                off += len;
+
+                if(off == iov[seg].iov_len)
+                {
+                    seg++;
+                    off = 0;
+                }
             }
         }
 
-        //new_db--;
-        i = 0;
-        bnum++;
-        //cur_blk_num = get_data_block(&datablock, inode, bnum);
+        if(n < 0)
+        {
+            ret = ret > 0 ? ret : n;
+            break;
+        }
+
+        ret += n;
+
+        if(n < chunk)
+            break;
     }
 
-    open_file_table[file_number].seek_position += bytes_r;
+    free(stage);
 
-    return bytes_r;
+    return io_batch_end(ret);
+}
+
+long long file_lseek64(int file_number, long long offset, int command)
+{
+    long long ret;
+
+    //writing out the write buffer and growing the file are one batch
+    io_batch_begin();
+    ret = seek_to(file_number, offset, command);
+
+    if(io_batch_end(SUCCESS) != SUCCESS && ret >= 0)
+        return ERR_INTERNAL;
 
+    return ret;
 }
 
-int file_lseek(int file_number, int offset, int command)
+long long seek_to(int file_number, long long offset, int command)
 {
-    struct inode_block *inode_block = NULL;
     struct inode *inode = NULL;
-    struct datablock *datablock = NULL;
-    int copened, inum, spos;
-    int file_size; //in bytes
-    int pos, bnum, bidx;
-    int new_db = 0;
-    int cur_blk_num;
-    int new_seek=0;
-    int db_needed=0;
+    int copened, inum;
+    long long spos;
+    long long file_size; //in bytes
+    long long new_seek=0;
+    long long db_needed=0;
 
     copened = open_file_table[file_number].currently_opened;
     inum = open_file_table[file_number].inode_number;
@@ -1315,9 +5281,12 @@ int file_lseek(int file_number, int offset, int command)
         return ERR_INTERNAL;
     }
 
-    get_inode(&inode_block, &inode, inum);
+    if(wb_flush(&open_file_table[file_number]))
+        return ERR_INTERNAL;
 
-    file_size = 512 * inode->num_blocks;
+    inode = open_file_table[file_number].inode;
+
+    file_size = (long long)BLOCK_SIZE * inode->num_blocks;
 
     if(command == LSEEK_FROM_CURRENT)
     {
@@ -1326,7 +5295,7 @@ int file_lseek(int file_number, int offset, int command)
     else if(command == LSEEK_ABSOLUTE)
     {
         new_seek = offset;
-        DEBUG1 && printf("newseek = %d \n", new_seek);
+        DEBUG1 && printf("newseek = %lld \n", new_seek);
     }
     else if(command == LSEEK_END)
     {
@@ -1339,114 +5308,342 @@ int file_lseek(int file_number, int offset, int command)
 
     }
 
-    if(new_seek >= 0 && new_seek <= file_size)
+    if(new_seek >= 0 && new_seek <= file_size)
+    {
+        open_file_table[file_number].seek_position = new_seek;
+        return new_seek;
+    }
+    else if(new_seek > file_size)
+    {
+        db_needed = (new_seek / BLOCK_SIZE) - inode->num_blocks;
+
+        //past the largest file there is, grow as far as we can and fail below
+        if(new_seek / BLOCK_SIZE > max_file_blocks())
+            db_needed = max_file_blocks() - inode->num_blocks + 1;
+
+        if(db_needed > 0)
+        {
+            //cannot get all of them, must be out of space
+            db_needed -= add_data_blocks(inum, db_needed, NULL);
+        }
+
+        if(db_needed == 0)
+        {
+            open_file_table[file_number].seek_position = new_seek;
+            return new_seek;
+        }
+        else
+        {
+            new_seek = (long long)(inode->num_blocks-1)*BLOCK_SIZE + BLOCK_SIZE-1;
+            return new_seek;
+        }
+    }
+    else
+    {
+        DEBUG2 && printf("error invalid offset \n");
+        return ERR_INVALID_LSEEK_OFFSET;
+    }
+
+    //printf("num_data_blocks = %d \n", inode->num_blocks);
+    //printf("file_size = %d \n", file_size);
+
+    //bnum = spos / 512;
+    //bidx = spos % 512;
+}
+
+int file_lseek(int file_number, int offset, int command)
+{
+    long long ret = file_lseek64(file_number, offset, command);
+
+    //positions past 2 GB can only be reported by file_lseek64
+    if(ret > INT_MAX)
+        return ERR_INVALID_LSEEK_OFFSET;
+
+    return ret;
+}
+
+int file_create(char *path)
+{
+    int ret;
+    io_batch_begin();
+    ret = create_file(0, path, 0);
+    return io_batch_end(ret);
+}
+
+int file_mkdir(char *path)
+{
+    int ret;
+    io_batch_begin();
+    ret = create_file(0, path, 1);
+    return io_batch_end(ret);
+}
+
+//adds name to an open addressing set of size slots (a power of two), 0 if it was already there
+int name_set_add(char **set, int size, char *name)
+{
+    unsigned int i = dir_hash(name) & (size - 1);
+
+    while(set[i] != NULL)
+    {
+        if(strcmp(set[i], name) == 0)
+            return 0;
+
+        i = (i + 1) & (size - 1);
+    }
+
+    set[i] = name;
+    return 1;
+}
+
+int file_create_batch(char *dir_path, char **names, int count)
+{
+    io_batch_begin();
+    return io_batch_end(create_batch(dir_path, names, count));
+}
+
+int create_batch(char *dir_path, char **names, int count)
+{
+    struct inode *dir_inode = NULL;
+    struct directory *dir = NULL;
+    struct directory_entry *old = NULL;
+    BLOCK *new_blocks = NULL;
+    char **set;
+    int *inodes;
+    int wd, hashed, n, i, k, slot, first_slot, size, need, got, b, block_num, old_count, used, taken, first, start;
+    int s = SUCCESS;
+
+    if((wd = path_to_inode(dir_path)) < 0)
+        return ERR_FILE_NOT_FOUND;
+
+    if(get_inode(&dir_inode, wd))
+        return ERR_INTERNAL;
+
+    if(dir_inode->is_dir == 0)
+    {
+        release_inode(wd);
+        return ERR_NOT_A_DIR;
+    }
+
+    //hashed directories are filled bucket by bucket in memory, plain ones get scanned once
+    //up front and filled block by block at the end
+    hashed = dir_inode->is_dir == DIR_HASHED;
+    old_count = hashed ? 0 : dir_inode->num_blocks * DIRENTS_PER_BLOCK;
+    used = 0;
+
+    for(size = 16; size < 2 * (old_count + count); size *= 2)
+        ;
+
+    set = calloc(size, sizeof(char *));
+    inodes = malloc(sizeof(int) * (count + 1));
+
+    if(old_count > 0)
+    {
+        old = malloc((size_t)dir_inode->num_blocks * BLOCK_SIZE);
+
+        for(i = 0; i < dir_inode->num_blocks; i++)
+        {
+            if((block_num = bmap(dir_inode, i)) < 0 || !read_block(file, &old[i * DIRENTS_PER_BLOCK], block_num))
+            {
+                DEBUG2 && printf("error reading dir block\n");
+                release_inode(wd);
+                free(old);
+                free(set);
+                free(inodes);
+                return ERR_INTERNAL;
+            }
+        }
+
+        for(i = 0; i < old_count; i++)
+        {
+            if(old[i].inode_number > 0)
+            {
+                name_set_add(set, size, old[i].filename);
+                used++;
+            }
+        }
+    }
+
+    //take the names in order until one can't be created, hashed directories find the ones
+    //that exist when they fill their buckets
+    for(n = 0; n < count; n++)
+    {
+        if(names[n][0] == '\0' || strlen(names[n]) >= sizeof(old->filename) || strchr(names[n], '/'))
+            break;
+
+        if(!name_set_add(set, size, names[n]))
+            break;
+
+        if((inodes[n] = get_free_inode()) < 0)
+            break;
+    }
+
+    taken = n;
+
+    //a plain directory that would outgrow its first block becomes a hash table first, as add_dir_entry does
+    if(!hashed && (fs_features & FORMAT_DIR_INDEX) &&
+       n > (dir_inode->num_blocks == 0 ? DIRENTS_PER_BLOCK : old_count - used))
+    {
+        start = dir_inode->num_blocks;
+
+        if((start == 0 && add_data_block(wd) < 0) || dir_index_create(dir_inode, wd) != SUCCESS)
+        {
+            dir_trim(dir_inode, wd, start);
+            n = 0;
+        }
+        else
+        {
+            hashed = 1;
+        }
+    }
+
+    i = 0;
+
+    if(hashed && n > 0 && (i = dir_hashed_add_batch(dir_inode, wd, names, inodes, n)) < 0)
     {
-        open_file_table[file_number].seek_position = new_seek;
-        return new_seek;
+        s = i;
+        i = 0;
     }
-    else if(new_seek > file_size)
+
+    //a directory block that can't be written takes its names and all after them back out,
+    //so what is reported as created is always a prefix of names with entries on disk
+    if(!hashed && n > 0)
     {
-        db_needed = (new_seek / 512) - inode->num_blocks;
+        dir = malloc(BLOCK_SIZE);
 
-        while(db_needed > 0)
+        //the free slots of the last block first, plain directories are packed
+        if(dir_inode->num_blocks > 0)
         {
-            int new_db_num;
+            block_num = bmap(dir_inode, dir_inode->num_blocks - 1);
+            memcpy(dir, &old[(dir_inode->num_blocks - 1) * DIRENTS_PER_BLOCK], BLOCK_SIZE);
 
-            new_db_num = add_data_block(inum);
-            get_inode(&inode_block, &inode, inum);
-            if(new_db_num <=0)
+            for(slot = 0; slot < DIRENTS_PER_BLOCK && dir->entries[slot].inode_number > 0; slot++)
+                ;
+
+            if(slot < DIRENTS_PER_BLOCK)
             {
-                //cannot get anymore blocks!! must be out of space
-                //we will write what we can
-                break;
+                for(first_slot = slot; slot < DIRENTS_PER_BLOCK && i < n; slot++, i++)
+                {
+                    strcpy(dir->entries[slot].filename, names[i]);
+                    dir->entries[slot].inode_number = inodes[i];
+                }
+
+                if(!write_block(file, dir, block_num))
+                {
+                    //none of them made it, the slots are free again and nothing after them is tried
+                    DEBUG2 && printf("error writing dir block\n");
+                    memset(&dir->entries[first_slot], 0, (slot - first_slot) * sizeof(struct directory_entry));
+                    n = i = 0;
+                }
             }
-            db_needed--;
         }
 
-        if(db_needed == 0)
-        {
-            open_file_table[file_number].seek_position = new_seek;
-            return new_seek;
-        }
-        else
+        //then whole new blocks, added to the directory in one go
+        need = (n - i + DIRENTS_PER_BLOCK - 1) / DIRENTS_PER_BLOCK;
+
+        if(need > 0)
         {
-            new_seek = (inode->num_blocks-1)*512 + 511;
-            return new_seek;
+            new_blocks = malloc(sizeof(BLOCK) * need);
+            start = dir_inode->num_blocks;
+            got = add_data_blocks_for(wd, need, new_blocks, (long long)start * BLOCK_SIZE,
+                                      (long long)(start + need) * BLOCK_SIZE);
+
+            for(b = 0; b < got; b++)
+            {
+                memset(dir, 0, BLOCK_SIZE);
+                first = i;
+
+                for(slot = 0; slot < DIRENTS_PER_BLOCK && i < n; slot++, i++)
+                {
+                    strcpy(dir->entries[slot].filename, names[i]);
+                    dir->entries[slot].inode_number = inodes[i];
+                }
+
+                //the directory stays packed, this block and the ones after it go back
+                if(!write_block(file, dir, new_blocks[b]))
+                {
+                    DEBUG2 && printf("error writing dir block\n");
+                    dir_trim(dir_inode, wd, start + b);
+                    n = i = first;
+                    break;
+                }
+            }
+
+            free(new_blocks);
         }
+
+        free(dir);
     }
-    else
+
+    for(k = 0; k < i; k++)
     {
-        DEBUG2 && printf("error invalid offset \n");
-        return ERR_INVALID_LSEEK_OFFSET;
+        dcache_set(wd, names[k], inodes[k]);
     }
 
-    //printf("num_data_blocks = %d \n", inode->num_blocks);
-    //printf("file_size = %d \n", file_size);
-
-    //bnum = spos / 512;
-    //bidx = spos % 512;
-}
+    //out of space for the directory or a failed write, the inodes that got no entry go back
+    for(k = i; k < taken; k++)
+    {
+        if(inodes[k] > 0)
+            erase_inode(inodes[k]);
+    }
 
-int file_create(char *path)
-{
-    int ret;
-    ret = create_file((path), 0);
-    return ret;
-}
+    release_inode(wd);
+    free(old);
+    free(set);
+    free(inodes);
 
-int file_mkdir(char *path)
-{
-    int ret;
-    ret = create_file((path), 1);
-    return ret;
+    return s == SUCCESS ? i : s;
 }
 
 
 
 int erase_inode(int inode_num)
 {
-    struct inode_block *ib = NULL;
     struct inode *inode = NULL;
-    struct directory *dir = NULL;
-    struct datablock *datablock = NULL;
-    struct indirection_block *idb = malloc(sizeof(struct indirection_block));
-    struct indirection_block *idb2 = malloc(sizeof(struct indirection_block));
-    struct superblock *sb = malloc(sizeof(struct superblock));
-    int cur_db_num, i;
+    struct superblock *sb = fs_sb;
+    struct block_map map = {0};
+    int cur_db_num, i, levels;
 
-    if((get_inode(&ib, &inode, inode_num)) < 0)
+    if((get_inode(&inode, inode_num)) < 0)
     {
         DEBUG2 && printf("error get_inode\n");
         return -1;
     }
 
+    if(inode->is_dir != 0)
+        dcache_forget_dir(inode_num);
+    else
+        wb_discard(inode_num);
+
+    //inline data has no blocks to give back
+    if(IS_INLINE(inode))
+    {
+        memset(&inode->inline_mark, 0, sizeof(BLOCK) + INLINE_SIZE);
+        inode->num_blocks = 0;
+    }
+
+    if(fs_features & FORMAT_EXTENTS)
+    {
+        extent_free((struct extent_block *)&inode->extents);
+        memset(&inode->extents, 0, sizeof(struct extent_root));
+        inode->num_blocks = 0;
+    }
+
+    //walking back through the file touches each indirection block once
     while(inode->num_blocks > 0)
     {
-        cur_db_num = get_data_block(&datablock, inode, inode->num_blocks-1);
+        cur_db_num = bmap_cached(&map, inode, inode->num_blocks-1);
         make_free_datablock(cur_db_num);
         inode->num_blocks--;
     }
-    if(inode->indirect1 != 0)
-    {
-        make_free_datablock(inode->indirect1);
-        inode->indirect1 = 0;
-    }
-    if(inode->indirect2 !=0)
+    bmap_release(&map);
+    bmap_invalidate(inode_num);
+
+    for(levels = 1; levels <= MAP_LEVELS; levels++)
     {
-        if(!read_block(file, idb2, inode->indirect2))
-        {
-            return ERR_INTERNAL;
-        }
-        for(i=0; i<128; i++)
-        {
-            if(idb2->pointer[i] != 0)
-            {
-                make_free_datablock(idb2->pointer[i]);
-            }
-        }
-        make_free_datablock(inode->indirect2);
-        inode->indirect2 = 0;
+        free_indirection_tree(*inode_root(inode, levels), levels);
+        *inode_root(inode, levels) = 0;
     }
+
     for(i=0; i<10; i++)
     {
         inode->file_blocks[i] = 0;
@@ -1454,88 +5651,91 @@ int erase_inode(int inode_num)
     inode->is_dir = 0;
     inode->is_free = 1;
 
-    if(!read_block(file, sb, 1))
-    {
-        return ERR_INTERNAL;
-    }
-
     inode->next_free_inode = sb->free_inode_list;
     sb->free_inode_list = inode_num;
+    sb->files_allocated--;
+    superblock_changed();
 
-    if(!write_block(file, sb, 1))
-    {
-        return ERR_INTERNAL;
-    }
-    put_inode_block(ib, inode_num);
+    mark_inode_dirty(inode_num);
+    release_inode(inode_num);
 
+    return SUCCESS;
 }
 
 int trim_indirection_blocks(int inode_num)
 {
-    struct inode_block *ib = NULL;
     struct inode *inode = NULL;
-    struct indirection_block *idb = malloc(sizeof(struct indirection_block));
-    int num_blocks;
-
-
+    int s;
 
-    if((get_inode(&ib, &inode, inode_num)) < 0)
+    if((get_inode(&inode, inode_num)) < 0)
     {
         DEBUG2 && printf("error get_inode\n");
         return -1;
     }
 
-    num_blocks = inode->num_blocks;
+    s = trim_inode_indirection(inode, inode_num);
+    release_inode(inode_num);
 
+    return s;
+}
 
-    if(num_blocks < 10 && inode->indirect1 != 0)
-    {
-        //remove inode->indirect1
-        make_free_datablock(inode->indirect1);
-        inode->indirect1 = 0;
-        put_inode_block(ib, inode_num);
-        return 1;
-    }
+int trim_inode_indirection(struct inode *inode, int inode_num)
+{
+    struct block_map map;
+    BLOCK *ptr;
+    long long span;
+    int levels, idx, l, s;
+    int trimmed = 0;
 
-    if(num_blocks < (10+128) && inode->indirect2 != 0)
-    {
-        //remove inode->indirect2
-        make_free_datablock(inode->indirect2);
-        inode->indirect2 = 0;
-        put_inode_block(ib, inode_num);
-        return 1;
-    }
+    if(fs_features & FORMAT_EXTENTS)
+        return extent_trim(inode, inode_num);
+
+    bmap_invalidate(inode_num);
 
-    if(num_blocks >= (10+128) && num_blocks < (10+128+(128*128)))
+    //the block just removed is the file's new end, anything covering only it and later goes
+    if((levels = map_locate(inode->num_blocks, &idx, &span)) <= 0)
+        return 0;
+
+    memset(&map, 0, sizeof(struct block_map));
+    ptr = inode_root(inode, levels);
+
+    for(l = 0; l < levels && *ptr != 0; l++)
     {
-        if(((num_blocks - (10+128)) % 128) == 0)
+        if(idx % span == 0)
         {
-            //remove second level indirection block
-            if(!read_block(file, idb, inode->indirect2))
-            {
-                DEBUG2 && printf("Error reading indirection block\n");
-                return -1;
-            }
-            if( idb->pointer[(num_blocks - (10+128)) / 128] != 0)
-            {
-                make_free_datablock(idb->pointer[(num_blocks - (10+128)) / 128]);
-                idb->pointer[(num_blocks - (10+128)) / 128] = 0;
-                return 1;
-            }
-            //block to remove
-            //ib1->pointer[(block_num - (10+128)) / 128]
+            free_indirection_tree(*ptr, levels - l);
+            *ptr = 0;
+            trimmed = 1;
+
+            if(l == 0)
+                mark_inode_dirty(inode_num);
+            else
+                map.dirty[MAP_SLOT(levels) + l - 1] = 1;
+            break;
+        }
+
+        s = MAP_SLOT(levels) + l;
 
-            //int new_ind_block = get_free_datablock();
-            //ib1->pointer[(block_num - (10+128)) / 128]
-            //ib2->pointer[0] = new_db_num;
-            //inode->num_blocks++;
+        if(map_load(&map, s, *ptr))
+        {
+            DEBUG2 && printf("Error reading indirection block\n");
+            trimmed = -1;
+            break;
         }
+
+        span /= PTRS_PER_BLOCK;
+        ptr = &map.blk[s]->pointer[(idx / span) % PTRS_PER_BLOCK];
     }
-    return 0;
 
+    if(bmap_flush(&map))
+        trimmed = -1;
+
+    bmap_release(&map);
+
+    return trimmed;
 }
 
-int delete_file(char *path)
+int delete_file(int base, char *path)
 {
     char *lpath = malloc(sizeof(char)*strlen(path)+1);
     char *orig_path = malloc(sizeof(char)*strlen(path)+1);
@@ -1544,9 +5744,7 @@ int delete_file(char *path)
     char null_array[12];
     int wd, free_inode_num, found, s;
     int inode_num;
-    struct inode_block *ib = NULL;
     struct inode *inode = NULL;
-    struct inode_block *doomed_ib = NULL;
     struct inode *doomed_inode = NULL;
     struct directory *dir = NULL;
     struct datablock *datablock = NULL;
@@ -1565,28 +5763,22 @@ int delete_file(char *path)
     strcpy(lpath, path);
     strcpy(orig_path, path);
 
-    if(strlen(lpath) == 1)
+    if(strcmp(lpath, "/") == 0)
     {
-        if(lpath[0] == '/')
-        {
-            return ERR_FILE_EXISTS; //update this to correct val
-        }
-        else
-        {
-            return ERR_INVALID_PATH;
-        }
+        return ERR_FILE_EXISTS; //update this to correct val
     }
 
     ptr = strrchr(lpath, '/');
 
 
-    if(ptr == lpath+strlen(lpath)-1)
+    if(ptr != NULL && ptr == lpath+strlen(lpath)-1)
     {
         *ptr = '\0';
         ptr = strrchr(lpath, '/');
     }
 
-    ptr++;
+    //a bare name is in the starting directory itself
+    ptr = ptr == NULL ? lpath : ptr + 1;
 
     last = malloc(sizeof(char)*strlen(ptr)+1);
 
@@ -1594,52 +5786,63 @@ int delete_file(char *path)
 
     *ptr = '\0';
 
-    wd = path_to_inode(lpath);
+    wd = path_to_inode_from(base, lpath);
 
     DEBUG1 && printf("lpath = %s last = %s \n", lpath, last);
 
     //funct to remove all data blocks
 
-    if((doomed_inode_num = path_to_inode(orig_path)) < 0)
+    if((doomed_inode_num = path_to_inode_from(base, orig_path)) < 0)
     {
         DEBUG1 && printf("cannot delete, does not exist\n");
         return ERR_FILE_NOT_FOUND;
     }
 
-    if((get_inode(&doomed_ib, &doomed_inode, doomed_inode_num)) < 0)
+    if((get_inode(&doomed_inode, doomed_inode_num)) < 0)
     {
         DEBUG2 && printf("error get_inode\n");
         return -1;
     }
 
-    if(doomed_inode->is_dir != 0 && doomed_inode->num_blocks > 0)
+    if(doomed_inode->is_dir != 0 && !dir_is_empty(doomed_inode))
     {
         DEBUG1 && printf("cannot delete a none empty directory");
+        release_inode(doomed_inode_num);
         return ERR_INVALID_PATH;//should be a different error
     }
 
+    release_inode(doomed_inode_num);
+
     erase_inode(doomed_inode_num);
+    dcache_set(wd, last, -1);
 
 
     //funct to remove from dir
 
-    if((inode_num = path_to_inode(lpath)) < 0)
+    if((inode_num = path_to_inode_from(base, lpath)) < 0)
     {
         DEBUG2 && printf("error path_to_inode\n");
         return -1;
     }
 
-    if((get_inode(&ib, &inode, inode_num)) < 0)
+    if((get_inode(&inode, inode_num)) < 0)
     {
         DEBUG2 && printf("error get_inode\n");
         return -1;
     }
 
+    if(inode->is_dir == DIR_HASHED)
+    {
+        s = dir_hashed_remove(inode, last);
+        release_inode(inode_num);
+        return s;
+    }
+
     for(i=0; i<inode->num_blocks; i++)
     {
         cur_db_num = get_data_block(&datablock, inode, i);
         dir = (struct directory *)datablock;
-        for(j=0; j<32; j++)
+        for(j=0; j<DIRENTS_PER_BLOCK; j++)
         {
             if(strcmp(last,dir->entries[j].filename) == 0 )
             {
@@ -1659,6 +5862,7 @@ int delete_file(char *path)
 
     if(!foundit)
     {
+        release_inode(inode_num);
         return -1;
     }
 
@@ -1668,7 +5872,7 @@ int delete_file(char *path)
 
     if(last_db_num == cur_db_num)
     {
-        for(k=0; k<32; k++)
+        for(k=0; k<DIRENTS_PER_BLOCK; k++)
         {
             if(dir->entries[k].inode_number == 0)
             {
@@ -1698,15 +5902,15 @@ int delete_file(char *path)
             inode->num_blocks--;
             DEBUG1 && printf("inode->num_blocks = %d \n", inode->num_blocks);
             //write the inode back
-            put_inode_block(ib, inode_num);
-            trim_indirection_blocks(inode_num);
+            mark_inode_dirty(inode_num);
+            trim_inode_indirection(inode, inode_num);
         }
 
     }
     else
     {
 
-        for(k=0; k<32; k++)
+        for(k=0; k<DIRENTS_PER_BLOCK; k++)
         {
             if(ldir->entries[k].inode_number == 0)
             {
@@ -1737,31 +5941,37 @@ int delete_file(char *path)
             inode->num_blocks--;
             DEBUG1 && printf("inode->num_blocks = %d \n", inode->num_blocks);
             //write the inode back
-            put_inode_block(ib, inode_num);
-            trim_indirection_blocks(inode_num);
+            mark_inode_dirty(inode_num);
+            trim_inode_indirection(inode, inode_num);
         }
     }
+
+    release_inode(inode_num);
     return SUCCESS;
 }
 
 int make_free_datablock(int db_num)
 {
-    struct superblock *sb = malloc(sizeof(struct superblock));
-    struct free_data_block *fdb = malloc(sizeof(struct free_data_block));
+    struct superblock *sb = fs_sb;
+    struct free_data_block *fdb = malloc(BLOCK_SIZE);
     //struct datablock *empty_db = NULL;
 
     int i;
 
-    fdb->next_free_block = 0;
-    for(i=0; i < 508; i++)
+    if(fs_bitmap != NULL)
     {
-        fdb->pad[i] = 0;
+        //freed blocks are never read back in this format, only the bit matters
+        bitmap_mark(db_num - data_start, 1, 0);
+        sb->blocks_allocated--;
+        superblock_changed();
+        free(fdb);
+        return SUCCESS;
     }
 
-    if(!read_block(file, sb, 1))
+    fdb->next_free_block = 0;
+    for(i=0; i < BLOCK_SIZE - sizeof(BLOCK); i++)
     {
-        DEBUG2 && printf("Error reading superblock\n");
-        return -1;
+        fdb->pad[i] = 0;
     }
 
     //free_db_num = sb->free_data_block_list;
@@ -1789,13 +5999,10 @@ int make_free_datablock(int db_num)
         return -1;
     }
 
-    if(!write_block(file, sb, 1))
-    {
-        DEBUG2 && printf("Error writing superblock\n");
-        return -1;
-    }
+    sb->blocks_allocated--;
+    superblock_changed();
 
-    //fdb->next_free_block = -1;
+    free(fdb);
 
     return SUCCESS;
 }
@@ -1803,59 +6010,80 @@ int make_free_datablock(int db_num)
 
 int file_delete(char *path)
 {
-    struct inode_block *ib = NULL;
+    io_batch_begin();
+    return io_batch_end(file_delete_from(0, path));
+}
+
+int file_delete_from(int base, char *path)
+{
     struct inode *inode = NULL;
-    int inode_num;
-    if((inode_num = path_to_inode(path)) < 0)
+    int inode_num, is_dir;
+    if((inode_num = path_to_inode_from(base, path)) < 0)
     {
         DEBUG2 && printf("error path_to_inode\n");
         return ERR_INTERNAL;
     }
-    if((get_inode(&ib, &inode, inode_num)) < 0)
+    if((get_inode(&inode, inode_num)) < 0)
     {
         DEBUG2 && printf("error get_inode\n");
         return ERR_INTERNAL;
     }
-    if(inode->is_dir != 0)
+    is_dir = inode->is_dir;
+    release_inode(inode_num);
+
+    if(is_dir != 0)
     {
         DEBUG2 && printf("error not a file!\n");
         return ERR_NOT_A_FILE;
     }
-    return delete_file(path);
+    return delete_file(base, path);
 
 }
 
 int file_rmdir(char *path)
 {
-    struct inode_block *ib = NULL;
+    io_batch_begin();
+    return io_batch_end(file_rmdir_from(0, path));
+}
+
+int file_rmdir_from(int base, char *path)
+{
     struct inode *inode = NULL;
-    int inode_num;
-    if((inode_num = path_to_inode(path)) < 0)
+    int inode_num, is_dir;
+    if((inode_num = path_to_inode_from(base, path)) < 0)
     {
         DEBUG2 && printf("error path_to_inode\n");
         return ERR_INTERNAL;
     }
-    if((get_inode(&ib, &inode, inode_num)) < 0)
+    if((get_inode(&inode, inode_num)) < 0)
     {
         DEBUG2 && printf("error get_inode\n");
         return ERR_INTERNAL;
     }
-    if(inode->is_dir != 1)
+    is_dir = inode->is_dir;
+    release_inode(inode_num);
+
+    if(is_dir == 0)
     {
         DEBUG2 && printf("error not a dir!\n");
         return ERR_NOT_A_DIR;
     }
-    return delete_file(path);
+    return delete_file(base, path);
 
 }
 
 char **file_listdir(char *path)
 {
-    struct inode_block *ib = NULL;
+    return file_listdir_from(0, path);
+}
+
+char **file_listdir_from(int base, char *path)
+{
     struct inode *inode = NULL;
-    //struct directory *nd = malloc(sizeof(struct directory));
+    //struct directory *nd = malloc(BLOCK_SIZE);
     struct directory *cur_dir = NULL;
     struct datablock *datablock = NULL;
+    struct dir_index *index = NULL;
     int inode_num, s, i,j;
     char **array;
     char *word;
@@ -1865,14 +6093,14 @@ char **file_listdir(char *path)
     last = malloc(sizeof(char)*2);
     strcpy(last, "");
 
-    inode_num = path_to_inode(path);
+    inode_num = path_to_inode_from(base, path);
 
     if(inode_num < 0)
     {
         return NULL;
     }
 
-    s = get_inode(&ib, &inode, inode_num);
+    s = get_inode(&inode, inode_num);
     if(s < 0)
     {
         return NULL;
@@ -1882,16 +6110,27 @@ char **file_listdir(char *path)
     {
         array = malloc(sizeof(char *)*2);
         array[0] = last;
+        release_inode(inode_num);
         return array;
     }
 
-    array = malloc((sizeof(char *)*32*inode->num_blocks)+1) ;
+    //the index blocks of a hashed directory hold no entries
+    if(inode->is_dir == DIR_HASHED && get_data_block((struct datablock **)&index, inode, 0) < 0)
+    {
+        release_inode(inode_num);
+        return NULL;
+    }
+
+    array = malloc((sizeof(char *)*DIRENTS_PER_BLOCK*inode->num_blocks)+1) ;
     counter = 0;
     for(i=0; i < inode->num_blocks; i++)
     {
+        if(index != NULL && !dir_is_bucket(index, i))
+            continue;
+
         get_data_block(&datablock, inode, i);
         cur_dir = (struct directory *)datablock;
-        for(j=0; j<32 ; j++)
+        for(j=0; j<DIRENTS_PER_BLOCK ; j++)
         {
             if(cur_dir->entries[j].inode_number > 0)
             {
@@ -1904,21 +6143,218 @@ char **file_listdir(char *path)
         }
     }
     array[counter] = last;
+    free(index);
+    release_inode(inode_num);
     return array;
 }
 
 void file_printdir(char *path)
 {
-    char **array;
-    char **ptr;
+    struct fs_dirent entry;
+    int dir_number;
 
-    array = file_listdir(path);
-    ptr = array;
+    if((dir_number = file_opendir(path)) < 0)
+        return;
 
-    while(strcmp(*ptr, "") != 0)
+    while(file_readdir(dir_number, &entry) == 1)
     {
-        printf("%s\n", *ptr);
-        ptr++;
+        printf("%s\n", entry.name);
+    }
+
+    file_closedir(dir_number);
+}
+
+int file_opendir(char *path)
+{
+    return file_opendir_from(0, path);
+}
+
+int file_opendir_from(int base, char *path)
+{
+    struct inode *inode = NULL;
+    int inode_num, i;
+
+    if((inode_num = path_to_inode_from(base, path)) < 0)
+        return ERR_FILE_NOT_FOUND;
+
+    for(i = 0; i < MAX_OPEN_DIRS && open_dir_table[i].currently_opened; i++)
+        ;
+
+    if(i == MAX_OPEN_DIRS)
+        return ERR_TOO_MANY_FILES_OPEN;
+
+    if(get_inode(&inode, inode_num))
+        return ERR_INTERNAL;
+
+    if(inode->is_dir == 0)
+    {
+        release_inode(inode_num);
+        return ERR_NOT_A_DIR;
+    }
+
+    memset(&open_dir_table[i], 0, sizeof(struct open_dir_table_entry));
+    open_dir_table[i].inode_number = inode_num;
+    open_dir_table[i].currently_opened = 1;
+    open_dir_table[i].inode = inode;
+    open_dir_table[i].block = -1;
+    open_dir_table[i].buf = malloc(BLOCK_SIZE);
+
+    return i;
+}
+
+int file_readdir(int dir_number, struct fs_dirent *entry)
+{
+    struct open_dir_table_entry *d;
+    struct directory_entry *de;
+    struct inode *child = NULL;
+    struct dir_index *index;
+    int block_num, bucket;
+
+    if(dir_number < 0 || dir_number >= MAX_OPEN_DIRS || !open_dir_table[dir_number].currently_opened)
+        return ERR_FILE_NOT_OPEN;
+
+    d = &open_dir_table[dir_number];
+
+    for(;;)
+    {
+        //move on to the next block once this one is used up
+        if(d->block < 0 || d->index == DIRENTS_PER_BLOCK)
+        {
+            if(d->block + 1 >= d->inode->num_blocks)
+                return 0;
+
+            //the index blocks of a hashed directory hold no entries
+            if(d->inode->is_dir == DIR_HASHED)
+            {
+                if(get_data_block((struct datablock **)&index, d->inode, 0) < 0)
+                    return ERR_INTERNAL;
+
+                bucket = dir_is_bucket(index, d->block + 1);
+                free(index);
+
+                if(!bucket)
+                {
+                    d->block++;
+                    d->index = DIRENTS_PER_BLOCK;
+                    continue;
+                }
+            }
+
+            if((block_num = bmap_cached(&d->map, d->inode, d->block + 1)) < 0 ||
+               !read_block(file, d->buf, block_num))
+            {
+                DEBUG2 && printf("error reading dir block\n");
+                return ERR_INTERNAL;
+            }
+
+            d->block++;
+            d->index = 0;
+        }
+
+        de = &d->buf->entries[d->index++];
+
+        //hashed directories have holes in every block, plain ones are packed
+        if(de->inode_number > 0)
+            break;
+
+        if(d->inode->is_dir != DIR_HASHED)
+            d->index = DIRENTS_PER_BLOCK;
+    }
+
+    strcpy(entry->name, de->filename);
+    entry->inode_number = de->inode_number;
+    entry->is_dir = 0;
+
+    if(get_inode(&child, de->inode_number) == 0)
+    {
+        entry->is_dir = child->is_dir != 0;
+        release_inode(de->inode_number);
     }
+
+    return 1;
+}
+
+void file_closedir(int dir_number)
+{
+    if(dir_number < 0 || dir_number >= MAX_OPEN_DIRS || !open_dir_table[dir_number].currently_opened)
+        return;
+
+    open_dir_table[dir_number].currently_opened = 0;
+    bmap_release(&open_dir_table[dir_number].map);
+    free(open_dir_table[dir_number].buf);
+    release_inode(open_dir_table[dir_number].inode_number);
+}
+
+int dir_base(int dir_number)
+{
+    if(dir_number < 0 || dir_number >= MAX_OPEN_DIRS || !open_dir_table[dir_number].currently_opened)
+        return ERR_FILE_NOT_OPEN;
+
+    return open_dir_table[dir_number].inode_number;
+}
+
+int file_open_at(int dir_number, char *path)
+{
+    int base = dir_base(dir_number);
+
+    return base < 0 ? base : file_open_from(base, path);
+}
+
+int file_create_at(int dir_number, char *path)
+{
+    int base = dir_base(dir_number);
+
+    if(base < 0)
+        return base;
+
+    io_batch_begin();
+    return io_batch_end(create_file(base, path, 0));
+}
+
+int file_mkdir_at(int dir_number, char *path)
+{
+    int base = dir_base(dir_number);
+
+    if(base < 0)
+        return base;
+
+    io_batch_begin();
+    return io_batch_end(create_file(base, path, 1));
+}
+
+int file_delete_at(int dir_number, char *path)
+{
+    int base = dir_base(dir_number);
+
+    if(base < 0)
+        return base;
+
+    io_batch_begin();
+    return io_batch_end(file_delete_from(base, path));
+}
+
+int file_rmdir_at(int dir_number, char *path)
+{
+    int base = dir_base(dir_number);
+
+    if(base < 0)
+        return base;
+
+    io_batch_begin();
+    return io_batch_end(file_rmdir_from(base, path));
+}
+
+char **file_listdir_at(int dir_number, char *path)
+{
+    int base = dir_base(dir_number);
+
+    return base < 0 ? NULL : file_listdir_from(base, path);
+}
+
+int file_opendir_at(int dir_number, char *path)
+{
+    int base = dir_base(dir_number);
+
+    return base < 0 ? base : file_opendir_from(base, path);
 }
 
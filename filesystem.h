@@ -1,4 +1,5 @@
 #include<stdio.h>
+#include<sys/uio.h>
 
 #define ERR_INTERNAL -20
 #define ERR_MIN_BLOCKS -21
@@ -8,25 +9,68 @@
 #define ERR_NOT_A_FILE -25
 #define ERR_NOT_A_DIR -26
 #define ERR_INVALID_DISK_FILE -27
+#define ERR_INVALID_BLOCK_SIZE -28
+#define ERR_DISK_TOO_LARGE -29
 
-#define BLOCK_SIZE 512
+// block size of the open (or being formatted) disk, picked at format time and read back on open
+#define BLOCK_SIZE fs_block_size
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
 #define MAX_OPEN_FILES 20
+#define MAX_OPEN_DIRS 20
+
+// default number of blocks held in the in-process block cache
+#define CACHE_SIZE 1024
+
+// default size in bytes of the write buffer of each open file
+#define WRITE_BUFFER_SIZE 4096
+
+// smallest and largest readahead window in blocks, it doubles on each sequential refill
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX 64
+
+// inodes held in the inode cache before it starts evicting, it grows past this if all are in use
+#define INODE_CACHE_SIZE 256
+
+// directory lookups remembered by path_to_inode, one slot per hash of (directory, name)
+#define DENTRY_CACHE_SIZE 1024
+
+// most blocks moved by a single preadv/pwritev
+#define MAX_IOV_BLOCKS 256
+
+// submission queue depth of the io_uring backend, also the number of staged block writes
+#define URING_DEPTH 64
+
+// size of each O_DIRECT bounce buffer and how many of them are kept around
+#define DIO_BUF_SIZE 65536
+#define DIO_POOL_SIZE 4
+
+// the in-memory superblock is written back after this many updates
+#define SUPERBLOCK_SYNC_INTERVAL 1024
+
+// marks superblocks written with the extension fields below, older images have garbage there
+#define SB_EXT_MAGIC 0x46535832
+
+// one bit per data block in the free block bitmap, a set bit means the block is in use
+#define BITS_PER_BLOCK (BLOCK_SIZE*8)
+#define BITS_PER_WORD (sizeof(unsigned long)*8)
 
 typedef unsigned char BYTE;
 typedef unsigned int BLOCK;
 
-// 512 Bytes
+// the block structs below are sized for MAX_BLOCK_SIZE, only the first BLOCK_SIZE bytes are on
+// disk so buffers for them are allocated with BLOCK_SIZE, never sizeof
 struct bootblock
 {
-    BLOCK padding[128];
+    BLOCK padding[MAX_BLOCK_SIZE / sizeof(BLOCK)];
 };
 
 struct datablock
 {
-    BYTE byte[512];
+    BYTE byte[MAX_BLOCK_SIZE];
 };
 
-// 512 Bytes
+// 512 Bytes, the rest of the block is unused
 struct superblock
 {
     int fs_type;
@@ -39,16 +83,56 @@ struct superblock
 
     BLOCK free_data_block_list;
 
-    BYTE padding[480];
+    // only valid when ext_magic == SB_EXT_MAGIC
+    int ext_magic;
+    int features; // FORMAT_* flags the disk was formatted with
+    BLOCK bitmap_start;
+    int bitmap_blocks;
+    BLOCK data_start;
+
+    // with FORMAT_LAZY, inodes from inode_hwm and data blocks from data_start + data_hwm
+    // have never been handed out and are not on the free lists
+    int inode_hwm;
+    int data_hwm;
+
+    int block_size;
+
+    // size of the disk in blocks, disk_size is only meaningful when it fits an int
+    int disk_blocks;
+
+    BYTE padding[444];
 };
 
-// 512 Bytes
 struct free_data_block
 {
     BLOCK next_free_block;
-    BYTE pad[508];
+    BYTE pad[MAX_BLOCK_SIZE - sizeof(BLOCK)];
+};
+
+// a run of blocks, with FORMAT_EXTENTS files are mapped by these instead of one pointer per block
+struct extent
+{
+    int file_block; // first block of the file the run covers
+    BLOCK start;    // first disk block of the run, or the child node in an index node
+    int len;        // 0 in an index node
 };
 
+// the top of the extent tree, stored in the inode in place of the block pointers
+#define ROOT_EXTENTS 3
+struct extent_root
+{
+    int entries;
+    int depth; // 0 when the entries are the runs themselves
+    struct extent ext[ROOT_EXTENTS];
+};
+
+// with FORMAT_INLINE a one block file can keep that block's first INLINE_SIZE bytes in the inode
+// instead, the rest of the block reads as zeros. A 0 where the first block pointer (or the extent
+// count) would be marks it, block 0 is the bootblock and never file data
+#define INLINE_SIZE 44
+#define IS_INLINE(inode) \
+    ((fs_features & FORMAT_INLINE) && (inode)->num_blocks == 1 && (inode)->inline_mark == 0)
+
 // 64 Bytes
 struct inode
 {
@@ -56,15 +140,26 @@ struct inode
     int is_free;
     int num_blocks;
     int is_dir;
-    BLOCK file_blocks[10];
-    BLOCK indirect1;
-    BLOCK indirect2;
+    union
+    {
+        struct
+        {
+            BLOCK file_blocks[10];
+            BLOCK indirect1;
+            BLOCK indirect2;
+        };
+        struct extent_root extents; // FORMAT_EXTENTS
+        struct
+        {
+            BLOCK inline_mark;
+            BYTE inline_data[INLINE_SIZE]; // FORMAT_INLINE
+        };
+    };
 };
 
-// 512 Bytes
 struct inode_block
 {
-    struct inode inodes[8];
+    struct inode inodes[MAX_BLOCK_SIZE / sizeof(struct inode)];
 };
 
 struct directory_entry
@@ -73,16 +168,141 @@ struct directory_entry
     int inode_number;
 };
 
-// 512 Bytes
 struct directory
 {
-    struct directory_entry entries[32];
+    struct directory_entry entries[MAX_BLOCK_SIZE / sizeof(struct directory_entry)];
 };
 
-// 512 bytes
 struct indirection_block
 {
-    BLOCK pointer[128];
+    BLOCK pointer[MAX_BLOCK_SIZE / sizeof(BLOCK)];
+};
+
+// a node of the extent tree below the root, laid out like struct extent_root with more entries
+struct extent_block
+{
+    int entries;
+    int depth;
+    struct extent ext[(MAX_BLOCK_SIZE - 2 * sizeof(int)) / sizeof(struct extent)];
+};
+
+#define EXTENTS_PER_BLOCK ((int)((BLOCK_SIZE - 2 * sizeof(int)) / sizeof(struct extent)))
+
+// block 0 of a DIR_HASHED directory, the slot table has 1 << depth slots and is spread over
+// the directory blocks listed in table, every other block of the directory is a bucket
+struct dir_index
+{
+    int depth;
+    int num_table;
+    int table[(MAX_BLOCK_SIZE - 2 * sizeof(int)) / sizeof(int)];
+};
+
+// a slot of the table, the 1 << (global depth - depth) slots whose low depth bits match all
+// point at the same bucket
+struct dir_slot
+{
+    int block; // directory block of the bucket
+    int depth; // local depth of the bucket
+};
+
+struct dir_slot_block
+{
+    struct dir_slot slots[MAX_BLOCK_SIZE / sizeof(struct dir_slot)];
+};
+
+// a DIR_HASHED directory being filled in memory by file_create_batch, directory block b is in
+// blocks[b] once read or added (block 0 is the index) and is written back at the end if dirty[b]
+struct dir_batch
+{
+    struct inode *inode;
+    int inode_num;
+    int start; // blocks the directory had before the batch
+    int cap;
+    void **blocks;
+    char *dirty;
+};
+
+#define DIR_SLOTS_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(struct dir_slot)))
+#define DIR_MAX_TABLE ((int)((BLOCK_SIZE - 2 * sizeof(int)) / sizeof(int)))
+
+// with FORMAT_LARGE the last direct pointer holds the triple indirection block instead, like
+// the indirect pointers at the end of an ext2 inode's block array
+#define NUM_DIRECT ((fs_features & FORMAT_LARGE) ? 9 : 10)
+#define INDIRECT3(inode) ((inode)->file_blocks[9])
+#define MAP_LEVELS ((fs_features & FORMAT_LARGE) ? 3 : 2)
+#define MAP_SLOTS 6
+
+// how many of each thing fit in one block of the current size
+#define PTRS_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(BLOCK)))
+#define INODES_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(struct inode)))
+#define DIRENTS_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(struct directory_entry)))
+
+// one slot of the block cache, block_num is -1 when the slot is unused
+struct cache_entry
+{
+    int block_num;
+    int dirty;
+    int referenced; // CLOCK reference bit
+    int next;       // next slot in the same hash chain, -1 ends the chain
+    BYTE *data;
+};
+
+// a remembered lookup of name in directory parent, inode_num is -1 when the name is known not to exist
+struct dentry_cache_entry
+{
+    int parent; // -1 for an unused slot
+    char name[12];
+    int inode_num;
+};
+
+// one cached inode, inode_num is -1 when the slot is unused
+struct inode_cache_entry
+{
+    int inode_num;
+    int refcount;   // get_inode calls not yet released plus open file handles
+    int dirty;
+    int referenced; // CLOCK reference bit
+    int next;       // next slot in the same hash chain, -1 ends the chain
+    struct inode inode;
+};
+
+// io_uring rings mapped from the kernel plus the staged single block writes
+struct uring
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned entries;
+    int queued; // submitted or about to be, not yet completed
+    int failed;
+
+    BYTE *stage;
+    int stage_block[URING_DEPTH];
+    struct iovec stage_iov[URING_DEPTH];
+    int num_staged;
+};
+
+// copies of the indirection blocks last used to map one inode's blocks, one per level of each
+// tree: slot 0 for indirect1, 1-2 for indirect2 and 3-5 for the triple indirection block.
+// With FORMAT_EXTENTS slot l holds the extent tree node l+1 levels below the root instead.
+// num is 0 when a slot holds nothing (block 0 is the bootblock, never an indirection block)
+struct block_map
+{
+    BLOCK num[MAP_SLOTS];
+    int dirty[MAP_SLOTS]; // only set while the mapping is being changed
+    struct indirection_block *blk[MAP_SLOTS];
 };
 
 /* This is the open_file_table structure..It contains more information about byte offsets and stuff like that
@@ -92,12 +312,34 @@ purposes.
 struct open_file_table_entry
 {
     int inode_number;
-    int seek_position;
+    long long seek_position;
     int currently_opened;
+    struct inode *inode; // the cached inode, held until file_close
+    struct block_map map;
+    BYTE *wbuf; // small writes not yet written out, wb_len bytes of the file from wb_pos
+    int wb_size;
+    int wb_len;
+    long long wb_pos;
+    long long ra_next; // where a sequential read would start next
+    int ra_window; // readahead window in blocks, 0 after a random read
+    int ra_end; // file block just past the ones read ahead
 };
 
+// a directory being read with file_readdir, one block of it is buffered at a time
+struct open_dir_table_entry
+{
+    int inode_number;
+    int currently_opened;
+    struct inode *inode; // held until file_closedir
+    struct block_map map;
+    int block; // file block in buf, -1 before the first read
+    int index; // next entry of buf to look at
+    struct directory *buf;
+};
 
 //GLOBALS
+extern int fs_block_size;
+extern int fs_features;
 int NUM_BLOCKS;
 int NUM_INODE_BLOCKS;
 int NUM_INODES;
@@ -113,14 +355,113 @@ struct open_file_table_entry open_file_table[MAX_OPEN_FILES];
 int write_block(int file, const void *buf, int block_num);
 int read_block(int file, void *buf, int block_num);
 
+//uncached block I/O, used by the cache to fill and write back slots
+int disk_write_block(int file, const void *buf, int block_num);
+int disk_read_block(int file, void *buf, int block_num);
+
+//posix_memalign'd buffer suitable for O_DIRECT transfers when opened with FS_OPEN_DIRECT
+void *alloc_block_buffer(size_t size);
+
+//O_DIRECT transfers of any size and alignment, unaligned edges are bounced through the pool
+int direct_pread(int file, void *buf, int len, off_t off);
+int direct_pwrite(int file, const void *buf, int len, off_t off);
+
+//sets up the io_uring backend, returns -1 (and leaves I/O synchronous) if unsupported
+int uring_init(void);
+
+//submits staged writes and tears the rings down, called from close_fs, returns an error if the writes failed
+int uring_destroy(void);
+
+//bracket one API call, with io_uring its single block writes are staged and submitted together
+//by the outermost io_batch_end. That returns ret, or ERR_INTERNAL if the submission failed
+void io_batch_begin(void);
+int io_batch_end(int ret);
+
+//vectored transfer of physically contiguous blocks starting at block_num
+int disk_writev_blocks(int file, const struct iovec *iov, int iovcnt, int block_num);
+int disk_readv_blocks(int file, const struct iovec *iov, int iovcnt, int block_num);
+
+//transfer count contiguous blocks in as few syscalls as the cache allows, returns bytes moved
+int write_blocks(int file, const void *buf, int block_num, int count);
+int read_blocks(int file, void *buf, int block_num, int count);
+
+//reads blocks with nothing but pread (or the mapping), for file_pread to use without fs_lock.
+//Only right for blocks that are not in the cache
+int read_blocks_unlocked(int file, void *buf, int block_num, int count);
+
+//pointer to block_num inside the disk mapping, NULL when not opened with FS_OPEN_MMAP
+void *map_block(int block_num);
+
+//the mapped or cached copy of a block (read in on a cache miss), NULL when neither is in use.
+//Only good until the next block access, dirty marks it changed
+void *block_data(int block_num, int dirty);
+
+//copies len bytes between buf and a block starting offset bytes in, into the block if to_block
+//is set, returns len or -1
+int copy_block_part(int block_num, int offset, void *buf, int len, int to_block);
+
+//sets the number of blocks the cache holds, takes effect on the next open_fs (0 disables it)
+void set_cache_size(int num_blocks);
+
+//sets the write buffer size of handles that have not buffered anything yet, 0 turns it off
+void set_write_buffer_size(int bytes);
+
+//allocates the block cache, called from open_fs
+int cache_init(void);
+
+//reads the uncached blocks of the count consecutive disk blocks from block_num into the cache
+void cache_prefetch(int block_num, int count);
+
+//writes every dirty cached block back to disk
+int cache_flush(void);
+
+//flushes and frees the block cache, called from close_fs
+int cache_destroy(void);
+
+//undoes what open_fs set up before it failed, frees sb and closes the disk file
+void open_fs_abort(struct superblock *sb);
+
+//writes the in-memory superblock back to block 1 if it changed
+int sync_superblock(void);
+
+//records an update to the in-memory superblock, syncing it every SUPERBLOCK_SYNC_INTERVAL updates
+void superblock_changed(void);
+
+//reads the allocation bitmap in at open_fs, and frees it again
+int bitmap_load(void);
+void bitmap_destroy(void);
+
+//first free data block at or after from (data block numbers relative to the bitmap), -1 if none
+int bitmap_next_zero(int from);
+
+//first used data block at or after from, NUM_DATA_BLOCKS if none
+int bitmap_next_one(int from);
+
+//finds a free run of want blocks, or the longest run there is, its length goes in len
+int bitmap_find_run(int want, int *len);
+
+//marks len data blocks from start as used (1) or free (0)
+void bitmap_mark(int start, int len, int used);
+
 //give an inode number return inode block containing that inode
 struct inode_block *get_inode_block(int inode_num);
 
 //give an inode number and inode block, will write back to correct place
 int put_inode_block(struct inode_block *ib, int inode_num);
 
-//give inode number, ref to inode_block and ref to inode, reads into inode_block and inode, returns error codes
-int get_inode(struct inode_block **inode_block, struct inode **inode, int inode_num);
+//give inode number and ref to inode, points inode at the cached copy and holds it in the cache, returns error codes
+int get_inode(struct inode **inode, int inode_num);
+
+//drops the hold get_inode took, the inode can be evicted once nothing holds it
+void release_inode(int inode_num);
+
+//the cached inode was changed, it goes back to disk through put_inode_block on eviction or flush
+void mark_inode_dirty(int inode_num);
+
+//inode cache setup and write back, only active between open_fs and close_fs
+int inode_cache_init(void);
+int inode_cache_flush(void);
+int inode_cache_destroy(void);
 
 //returns a free inode number, this function handles updating the superblock and removing inode from free list
 int get_free_inode(void);
@@ -128,24 +469,190 @@ int get_free_inode(void);
 //returns a free datablock number, this function handles updating the superblock removing from free db list
 int get_free_datablock(void);
 
+//allocates up to count free datablocks into blocks, physically contiguous where the
+//allocator can manage it, returns how many it got; all but blocks[first_full] to
+//blocks[first_full+num_full-1], which the caller overwrites whole, come back zeroed
+int get_free_datablocks(int count, BLOCK *blocks, int first_full, int num_full);
+
+//appends up to count new datablocks to an inode, writing the inode and each
+//indirection block once, returns how many were added (their numbers go in blocks if not NULL)
+int add_data_blocks(int inode_num, int count, BLOCK *blocks);
+
+//add_data_blocks for a write of bytes start to end, new blocks that write fills
+//completely are left for it instead of being zeroed first
+int add_data_blocks_for(int inode_num, int count, BLOCK *blocks, long long start, long long end);
+
 //adds a datablock to an inode (NEEDS MORE TESTING FOR LARGE FILES)
 int add_data_block(int inode_num);
 
 //attempts to add a new directory(or file) to an inode_num
 int add_dir_to_inode(int inode_num, char *n_dir, int n_inode_num);
 
+//same, for a caller already holding the directory's inode
+int add_dir_entry(struct inode *inode, int inode_num, char *n_dir, int n_inode_num);
+
+//with FORMAT_DIR_INDEX a directory that outgrows its first block becomes an extendible hash
+//table: is_dir is DIR_HASHED and the entry for a name is always in the bucket its slot of the
+//struct dir_index table points at. A full bucket splits in two on its own, the table only
+//doubles when that bucket already has a slot to itself
+#define DIR_HASHED 2
+
+unsigned int dir_hash(char *name);
+
+//gives back the blocks of a directory past its first num_blocks
+void dir_trim(struct inode *inode, int inode_num, int num_blocks);
+
+//turns a plain directory of one full block into a DIR_HASHED one with two buckets
+int dir_index_create(struct inode *inode, int inode_num);
+
+//the directory block of the bucket name belongs in, or -1
+int dir_bucket(struct inode *inode, char *name);
+
+//whether a block of a DIR_HASHED directory is a bucket rather than part of its index
+int dir_is_bucket(struct dir_index *index, int block);
+
+//doubles the slot table, ERR_DISK_FULL once it would outgrow the index block
+int dir_grow(struct inode *inode, int inode_num, struct dir_index *index);
+
+//splits the bucket name belongs in, doubling the table first if the bucket has only the one slot
+int dir_split(struct inode *inode, int inode_num, char *name);
+
+//adds or removes the entry for a name in a DIR_HASHED directory
+int dir_hashed_add(struct inode *inode, int inode_num, char *n_dir, int n_inode_num);
+int dir_hashed_remove(struct inode *inode, char *name);
+
+//dir_bucket, dir_split and adding blocks for a struct dir_batch, all in memory
+void *dir_batch_block(struct dir_batch *d, int block);
+int dir_batch_bucket(struct dir_batch *d, unsigned int hash);
+int dir_batch_add_blocks(struct dir_batch *d, int count);
+int dir_batch_split(struct dir_batch *d, unsigned int hash);
+
+//adds entries for names[0] to names[count-1] to a DIR_HASHED directory writing each block
+//touched once, returns how many from the first were added (up to one that exists or does
+//not fit) or ERR_INTERNAL. An inode whose entry may be on disk though it is not counted
+//is set to 0 in inodes, the caller must not free it
+int dir_hashed_add_batch(struct inode *inode, int inode_num, char **names, int *inodes, int count);
+
+//whether a directory has no entries left
+int dir_is_empty(struct inode *inode);
+
+//dentry cache, create_file and delete_file keep it up to date through dcache_set. dcache_lookup
+//returns 1 and sets inode_num (-1 for a negative entry) if (parent, name) is remembered
+int dcache_lookup(int parent, char *name, int *inode_num);
+void dcache_set(int parent, char *name, int inode_num);
+
+//forgets every lookup in a directory that is going away, its inode number may come back
+void dcache_forget_dir(int parent);
+void dcache_clear(void);
+
+//maps a block index within a file to its block number on disk, -1 on errors
+int bmap(struct inode *inode, int file_block_num);
+
+//returns how many blocks from file_block_num (at most max) are contiguous on disk,
+//the disk block of the first one is returned through first
+int bmap_run(struct block_map *map, struct inode *inode, int file_block_num, int max, int *first);
+
+//bmap through the indirection blocks held in map, loading the ones it is missing. map may be NULL
+int bmap_cached(struct block_map *map, struct inode *inode, int file_block_num);
+
+//drops the copies in every open file's map of inode_num, after its block mapping changed
+void bmap_invalidate(int inode_num);
+
+//writes back the indirection blocks changed through map
+int bmap_flush(struct block_map *map);
+
+//frees the buffers of a map
+void bmap_release(struct block_map *map);
+
+//points file block file_block_num of inode at block, allocating indirection blocks as the file
+//reaches them. Blocks must be set in order, the changed indirection blocks stay in map until bmap_flush
+int bmap_set(struct block_map *map, struct inode *inode, int file_block_num, BLOCK block);
+
+//the inode's slot holding the root of the indirection tree that is levels deep
+BLOCK *inode_root(struct inode *inode, int levels);
+
+//most blocks a file can have on the open disk
+int max_file_blocks(void);
+
+//frees an indirection block and the indirection blocks under it, levels counts it too
+int free_indirection_tree(BLOCK block_num, int levels);
+
+//moves an inline file's data out to a block of its own
+int inline_to_block(struct inode *inode, int inode_num);
+
+//FORMAT_EXTENTS versions of the block mapping, extent_map also sets left to how many blocks of
+//the file the run holding file_block_num covers from there on
+int extent_map(struct block_map *map, struct inode *inode, int file_block_num, int *left);
+int extent_append(struct block_map *map, struct inode *inode, int file_block_num, BLOCK block);
+int extent_trim(struct inode *inode, int inode_num);
+int extent_free(struct extent_block *node);
+
 //reads inode's file_block_num into dblk and returns the data block number for easy write back
 int get_data_block(struct datablock **dblk, struct inode *inode, int file_block_num);
 
+//same, mapping through map
+int get_mapped_block(struct block_map *map, struct datablock **dblk, struct inode *inode, int file_block_num);
+
 //returns -2 on errors, -1 if file not found, inode number >=0 if has file
 int has_file(struct inode *cur_inode, char *cur);
 
-//enter a path and 1 to create a directory, enter a path and 0 to creat a file, returns error codes
-int create_file(char *path, int is_dir);
+//enter a path and 1 to create a directory, enter a path and 0 to creat a file, returns error codes.
+//paths not starting with / are looked up from the directory inode base
+int create_file(int base, char *path, int is_dir);
 
 //given a path returns inode number or error codes if not found
 int path_to_inode(char *path);
 
+//same, paths not starting with / start at the directory inode base instead of the root
+int path_to_inode_from(int base, char *path);
+
+//the api functions starting at the directory inode base, the *_at functions turn a directory
+//handle into its inode and call these
+int file_open_from(int base, char *path);
+int file_delete_from(int base, char *path);
+int file_rmdir_from(int base, char *path);
+char **file_listdir_from(int base, char *path);
+int file_opendir_from(int base, char *path);
+
+//writes bytes at spos through an open file's block map, growing the file as needed.
+//Leaves the seek position alone and returns the number of bytes written
+int write_at(struct open_file_table_entry *entry, long long spos, void *buffer, int bytes);
+
+//reads bytes at spos through an open file's block map and moves its readahead window along.
+//Leaves the seek position alone and returns the number of bytes read
+int read_at(struct open_file_table_entry *entry, long long spos, void *buffer, int bytes);
+
+//copies the part of file_block's data that falls in a file_pread of bytes at offset into buffer
+void pread_piece(BYTE *buffer, long long offset, int bytes, int file_block, const BYTE *data);
+
+//file_lseek64 and file_create_batch, run inside an io_uring batch by those
+long long seek_to(int file_number, long long offset, int command);
+int create_batch(char *dir_path, char **names, int count);
+
+//file_readv and file_writev, moving the buffers through a staging buffer with file_read or file_write
+int file_vec(int file_number, const struct iovec *iov, int iovcnt, int to_file);
+
+//copies a small write at the seek position into the handle's write buffer and returns bytes,
+//or 0 if it has to go straight to write_at (after a wb_flush)
+int wb_write(struct open_file_table_entry *entry, void *buffer, int bytes);
+
+//writes out a handle's buffered writes, those of every handle on inode_num or of every open handle,
+//or drops them for a deleted file
+int wb_flush(struct open_file_table_entry *entry);
+int wb_flush_inode(int inode_num);
+int wb_flush_all(void);
+void wb_discard(int inode_num);
+
+//grows or drops the handle's readahead window for a read of bytes at spos and fetches
+//the window's blocks into the cache once the read gets close to its end
+void read_ahead(struct open_file_table_entry *entry, long long spos, int bytes);
+
+//inode number of the directory open as dir_number, or an error
+int dir_base(int dir_number);
+
+//adds name to an open addressing set of size slots (a power of two), 0 if it was already there
+int name_set_add(char **set, int size, char *name);
+
 //updates superblock and writes a freedatablock to db_num
 int make_free_datablock(int db_num);
 
@@ -157,8 +664,11 @@ int erase_inode(int inode_num);
 //blocks that are no longer needed.
 int trim_indirection_blocks(int inode_num);
 
+//same, for a caller already holding the inode
+int trim_inode_indirection(struct inode *inode, int inode_num);
+
 //this function deletes dirs or files, will wrap this for api
-int delete_file(char *path);
+int delete_file(int base, char *path);
 
 //this is the hack_funct...not being used atm
 int hack_funct();
@@ -7,7 +7,7 @@
 #include "api.h"
 #define TEST_SET_SIZE 1000000
 
-void test_fs()
+int test_fs()
 {
     int return_value;
     int file_number;
@@ -21,7 +21,7 @@ void test_fs()
     else
     {
         printf("Could not create file, failed test...\n");
-        return;
+        return -1;
     }
 
     return_value = file_create("/test2");
@@ -32,7 +32,7 @@ void test_fs()
     else
     {
         printf("Could not create file, failed test...\n");
-        return;
+        return -1;
     }
 
     printf("Printing root dir...should see /test1 and /test2...\n");
@@ -57,7 +57,7 @@ void test_fs()
     else
     {
         printf("Could not create file, failed test...\n");
-        return;
+        return -1;
     }
 
     file_number = return_value = file_open("/test_dir/test_file");
@@ -69,7 +69,7 @@ void test_fs()
     else
     {
         printf("Could not open file, failed test...\n");
-        return;
+        return -1;
     }
 
     printf("Doing read/write test...\n");
@@ -94,7 +94,7 @@ void test_fs()
         if(return_value != sizeof(long unsigned))
         {
             printf("Error while writing...\n");
-            return;
+            return -1;
         }
     }
 
@@ -111,7 +111,7 @@ void test_fs()
     else
     {
         printf("lseek error...\n");
-        return;
+        return -1;
     }
 
     long unsigned* restored_array = malloc(sizeof(long unsigned*)*TEST_SET_SIZE);
@@ -122,7 +122,7 @@ void test_fs()
         if(return_value != sizeof(long unsigned))
         {
             printf("Error while reading...\n");
-            return;
+            return -1;
         }
     }
 
@@ -138,7 +138,7 @@ void test_fs()
         else
         {
             printf("Error during compare...test_array[%i] = %lu, restored_array[%i] = %lu...\n", i, test_array[i], i, restored_array[i]);
-            return;
+            return -1;
         }
     }
 
@@ -154,7 +154,7 @@ void test_fs()
     else
     {
         printf("Error deleting file...\n");
-        return;
+        return -1;
     }
 
     printf("Removing dir...\n");
@@ -167,7 +167,611 @@ void test_fs()
     else
     {
         printf("Error removing dir...\n");
-        return;
+        return -1;
     }
     printf("Passed basic test...\n");
+    return 0;
+}
+
+// The basic sequence again on a disk of its own formatted with flags at block_size: a
+// directory big enough to need several blocks, a file reaching the indirect blocks and
+// one small enough to be inline, all read back after a reopen and then deleted.
+int test_format(int flags, int block_size)
+{
+    char name[32];
+    unsigned char *data, *restored;
+    int return_value, file_number, i;
+    int num_files = 300;
+    int size = 300000;
+
+    printf("Testing format flags %d, block size %d...\n", flags, block_size);
+
+    if(format_fs_opts("test_disk.dat", (1 << 24) / block_size, block_size, flags) != SUCCESS ||
+       open_fs("test_disk.dat") != SUCCESS)
+    {
+        printf("Could not format and open disk, failed test...\n");
+        return -1;
+    }
+
+    if(file_mkdir("/dir") != SUCCESS)
+    {
+        printf("Could not create dir, failed test...\n");
+        return -1;
+    }
+
+    for(i = 0; i < num_files; i++)
+    {
+        sprintf(name, "/dir/f%d", i);
+        if(file_create(name) != SUCCESS)
+        {
+            printf("Could not create %s, failed test...\n", name);
+            return -1;
+        }
+    }
+
+    data = malloc(size);
+    restored = malloc(size);
+
+    for(i = 0; i < size; i++)
+    {
+        data[i] = i * 7 + i / 251;
+    }
+
+    file_create("/big");
+    file_create("/small");
+
+    file_number = file_open("/big");
+    for(i = 0; i < size; i += 1000)
+    {
+        if(file_write(file_number, data + i, 1000) != 1000)
+        {
+            printf("Error while writing...\n");
+            return -1;
+        }
+    }
+    file_close(file_number);
+
+    file_number = file_open("/small");
+    if(file_write(file_number, data, 20) != 20)
+    {
+        printf("Error while writing...\n");
+        return -1;
+    }
+    file_close(file_number);
+
+    printf("Reopening...\n");
+    if(close_fs() != SUCCESS || open_fs("test_disk.dat") != SUCCESS)
+    {
+        printf("Could not reopen disk, failed test...\n");
+        return -1;
+    }
+
+    for(i = 0; i < num_files; i++)
+    {
+        sprintf(name, "/dir/f%d", i);
+        if((file_number = file_open(name)) < 0)
+        {
+            printf("Could not open %s, failed test...\n", name);
+            return -1;
+        }
+        file_close(file_number);
+    }
+
+    file_number = file_open("/big");
+    memset(restored, 0, size);
+    if(file_read(file_number, restored, size) != size || memcmp(data, restored, size) != 0)
+    {
+        printf("Error during compare of /big...\n");
+        return -1;
+    }
+    file_close(file_number);
+
+    file_number = file_open("/small");
+    memset(restored, 0, size);
+    if(file_read(file_number, restored, 20) != 20 || memcmp(data, restored, 20) != 0)
+    {
+        printf("Error during compare of /small...\n");
+        return -1;
+    }
+    file_close(file_number);
+
+    for(i = 0; i < num_files; i++)
+    {
+        sprintf(name, "/dir/f%d", i);
+        if(file_delete(name) != SUCCESS)
+        {
+            printf("Error deleting %s...\n", name);
+            return -1;
+        }
+    }
+
+    if(file_rmdir("/dir") != SUCCESS || file_delete("/big") != SUCCESS || file_delete("/small") != SUCCESS)
+    {
+        printf("Error deleting...\n");
+        return -1;
+    }
+
+    free(data);
+    free(restored);
+    close_fs();
+    unlink("test_disk.dat");
+
+    return 0;
+}
+
+// A file on a FORMAT_LARGE disk of 1024 byte blocks grown past 2 GB with file_lseek64, which
+// puts its last block behind the triple indirect block, written there and read back after a
+// reopen. The bitmap and lazy format keep making the 2 GB disk quick.
+int test_large_file()
+{
+    long long offset = (1LL << 31) + 12345;
+    int num_blocks = (int)(((1LL << 31) + (1LL << 28)) / 1024);
+    unsigned char data[100], restored[100];
+    int file_number, i, ret = -1;
+
+    printf("Testing a file past 2 GB...\n");
+
+    for(i = 0; i < sizeof(data); i++)
+    {
+        data[i] = i * 3 + 1;
+    }
+
+    if(format_fs_opts("test_disk.dat", num_blocks, 1024, FORMAT_LARGE|FORMAT_BITMAP|FORMAT_LAZY) != SUCCESS ||
+       open_fs("test_disk.dat") != SUCCESS)
+    {
+        printf("Could not format and open disk, failed test...\n");
+        unlink("test_disk.dat");
+        return -1;
+    }
+
+    file_create("/huge");
+    file_number = file_open("/huge");
+
+    if(file_lseek64(file_number, offset, LSEEK_ABSOLUTE) != offset ||
+       file_write(file_number, data, sizeof(data)) != sizeof(data))
+    {
+        printf("Error while writing past 2 GB...\n");
+    }
+    else if(file_close(file_number) != SUCCESS || close_fs() != SUCCESS || open_fs("test_disk.dat") != SUCCESS)
+    {
+        printf("Could not reopen disk, failed test...\n");
+        unlink("test_disk.dat");
+        return -1;
+    }
+    else
+    {
+        file_number = file_open("/huge");
+        memset(restored, 0, sizeof(restored));
+
+        if(file_lseek64(file_number, offset, LSEEK_ABSOLUTE) != offset ||
+           file_read(file_number, restored, sizeof(restored)) != sizeof(restored) ||
+           memcmp(data, restored, sizeof(data)) != 0)
+            printf("Error during compare past 2 GB...\n");
+        else if(file_lseek64(file_number, 0, LSEEK_END) < offset + (long long)sizeof(data))
+            printf("File ends before 2 GB, failed test...\n");
+        else
+            ret = 0;
+    }
+
+    file_close(file_number);
+
+    if(ret == 0 && file_delete("/huge") != SUCCESS)
+    {
+        printf("Error deleting...\n");
+        ret = -1;
+    }
+
+    close_fs();
+    unlink("test_disk.dat");
+
+    return ret;
+}
+
+void test_formats()
+{
+    int flags[] = {0, FORMAT_BITMAP, FORMAT_LAZY, FORMAT_BITMAP|FORMAT_LAZY, FORMAT_LARGE, FORMAT_EXTENTS,
+                   FORMAT_INLINE, FORMAT_DIR_INDEX, FORMAT_BITMAP|FORMAT_LAZY|FORMAT_EXTENTS|FORMAT_INLINE|FORMAT_DIR_INDEX};
+    int block_sizes[] = {512, 1024, 4096};
+    int f, b;
+
+    for(f = 0; f < sizeof(flags) / sizeof(flags[0]); f++)
+    {
+        for(b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++)
+        {
+            if(test_format(flags[f], block_sizes[b]))
+                return;
+        }
+    }
+
+    if(test_large_file())
+        return;
+
+    printf("Passed format tests...\n");
+}
+
+// The basic test again on a fresh disk opened with mode, the disk is closed and removed
+// whether it passes or not.
+int test_mode(int mode, char *mode_name)
+{
+    int ret;
+
+    printf("Testing with %s...\n", mode_name);
+
+    if(format_fs("test_disk.dat", 60480) != SUCCESS || open_fs_mode("test_disk.dat", mode) != SUCCESS)
+    {
+        printf("Could not format and open disk, failed test...\n");
+        unlink("test_disk.dat");
+        return -1;
+    }
+
+    ret = test_fs();
+
+    if(close_fs() != SUCCESS && ret == 0)
+    {
+        printf("Error closing disk, failed test...\n");
+        ret = -1;
+    }
+
+    unlink("test_disk.dat");
+
+    return ret;
+}
+
+void test_modes()
+{
+    if(test_mode(FS_OPEN_MMAP, "mmap") || test_mode(FS_OPEN_URING, "io_uring") ||
+       test_mode(FS_OPEN_DIRECT, "O_DIRECT"))
+        return;
+
+    printf("Passed mode tests...\n");
+}
+
+// Directory handles on a disk of their own formatted with flags: every entry of a directory
+// big enough to need several blocks read back with file_readdir, the one directory among
+// them told apart from the files.
+int test_readdir(int flags)
+{
+    struct fs_dirent entry;
+    char name[32];
+    int return_value, dir_number, i, entries, saw_sub;
+
+    printf("Testing directory handles, flags %d...\n", flags);
+
+    if(format_fs_opts("test_disk.dat", 8192, 512, flags) != SUCCESS || open_fs("test_disk.dat") != SUCCESS)
+    {
+        printf("Could not format and open disk, failed test...\n");
+        return -1;
+    }
+
+    if(file_mkdir("/d") != SUCCESS || file_mkdir("/d/sub") != SUCCESS)
+    {
+        printf("Could not create dir, failed test...\n");
+        return -1;
+    }
+
+    for(i = 0; i < 100; i++)
+    {
+        sprintf(name, "/d/n%d", i);
+        if(file_create(name) != SUCCESS)
+        {
+            printf("Could not create %s, failed test...\n", name);
+            return -1;
+        }
+    }
+
+    if((dir_number = file_opendir("/d")) < 0)
+    {
+        printf("Could not open dir, failed test...\n");
+        return -1;
+    }
+
+    //sub and n0 to n99
+    entries = saw_sub = 0;
+    while((return_value = file_readdir(dir_number, &entry)) == 1)
+    {
+        entries++;
+        if(strcmp(entry.name, "sub") == 0)
+            saw_sub = entry.is_dir;
+        else if(entry.is_dir)
+            entries = -1000;
+    }
+    file_closedir(dir_number);
+
+    if(return_value != 0 || entries != 101 || !saw_sub)
+    {
+        printf("Read %d entries from /d, failed test...\n", entries);
+        return -1;
+    }
+
+    if((dir_number = file_opendir("/d/sub")) < 0 || file_readdir(dir_number, &entry) != 0)
+    {
+        printf("Read an entry from an empty dir, failed test...\n");
+        return -1;
+    }
+    file_closedir(dir_number);
+
+    for(i = 0; i < 100; i++)
+    {
+        sprintf(name, "/d/n%d", i);
+        if(file_delete(name) != SUCCESS)
+        {
+            printf("Error deleting %s...\n", name);
+            return -1;
+        }
+    }
+
+    if(file_rmdir("/d/sub") != SUCCESS || file_rmdir("/d") != SUCCESS)
+    {
+        printf("Error removing dir...\n");
+        return -1;
+    }
+
+    close_fs();
+    unlink("test_disk.dat");
+
+    return 0;
+}
+
+// The _at functions relative to a directory handle: names with and without a slash below
+// the directory and an absolute path, which ignores the handle.
+int test_at(int flags)
+{
+    struct fs_dirent entry;
+    char **list;
+    int dir_number, sub_number, file_number;
+
+    printf("Testing the _at functions, flags %d...\n", flags);
+
+    if(format_fs_opts("test_disk.dat", 8192, 512, flags) != SUCCESS || open_fs("test_disk.dat") != SUCCESS)
+    {
+        printf("Could not format and open disk, failed test...\n");
+        return -1;
+    }
+
+    file_mkdir("/d");
+    if((dir_number = file_opendir("/d")) < 0)
+    {
+        printf("Could not open dir, failed test...\n");
+        return -1;
+    }
+
+    if(file_create_at(dir_number, "a") != SUCCESS || file_mkdir_at(dir_number, "sub") != SUCCESS ||
+       file_create_at(dir_number, "sub/b") != SUCCESS)
+    {
+        printf("Could not create relative to dir, failed test...\n");
+        return -1;
+    }
+
+    if((file_number = file_open_at(dir_number, "sub/b")) < 0 || file_close(file_number) != SUCCESS ||
+       (file_number = file_open_at(dir_number, "/d/a")) < 0 || file_close(file_number) != SUCCESS)
+    {
+        printf("Could not open relative to dir, failed test...\n");
+        return -1;
+    }
+
+    list = file_listdir_at(dir_number, "sub");
+    if(list == NULL || strcmp(list[0], "b") != 0 || strcmp(list[1], "") != 0)
+    {
+        printf("Wrong listing of sub, failed test...\n");
+        return -1;
+    }
+
+    if((sub_number = file_opendir_at(dir_number, "sub")) < 0 ||
+       file_readdir(sub_number, &entry) != 1 || strcmp(entry.name, "b") != 0 || entry.is_dir ||
+       file_readdir(sub_number, &entry) != 0)
+    {
+        printf("Wrong entries read from sub, failed test...\n");
+        return -1;
+    }
+    file_closedir(sub_number);
+
+    if(file_delete_at(dir_number, "sub/b") != SUCCESS || file_rmdir_at(dir_number, "sub") != SUCCESS ||
+       file_delete_at(dir_number, "a") != SUCCESS)
+    {
+        printf("Error deleting...\n");
+        return -1;
+    }
+
+    if((file_number = file_open("/d/a")) >= 0)
+    {
+        printf("Deleted file still opens, failed test...\n");
+        return -1;
+    }
+
+    file_closedir(dir_number);
+
+    if(file_rmdir("/d") != SUCCESS)
+    {
+        printf("Error removing dir...\n");
+        return -1;
+    }
+
+    close_fs();
+    unlink("test_disk.dat");
+
+    return 0;
+}
+
+// file_create_batch stopping at a duplicate, a name too long and a name that exists, then
+// a batch big enough to fill several directory blocks, all of it there after a reopen.
+int test_create_batch(int flags)
+{
+    char name[32];
+    char *batch[300];
+    char *dup_batch[] = {"c0", "c1", "c1", "c3"};
+    char *long_batch[] = {"c2", "waytoolongname", "c4"};
+    char *exists_batch[] = {"c3", "a", "c5"};
+    char **list;
+    int return_value, file_number, i, entries;
+    int num_files = sizeof(batch) / sizeof(batch[0]);
+
+    printf("Testing file_create_batch, flags %d...\n", flags);
+
+    if(format_fs_opts("test_disk.dat", 8192, 512, flags) != SUCCESS || open_fs("test_disk.dat") != SUCCESS)
+    {
+        printf("Could not format and open disk, failed test...\n");
+        return -1;
+    }
+
+    file_mkdir("/d");
+    file_create("/d/a");
+
+    if((return_value = file_create_batch("/d", dup_batch, 4)) != 2)
+    {
+        printf("Batch with a duplicate created %d, failed test...\n", return_value);
+        return -1;
+    }
+    if((return_value = file_create_batch("/d", long_batch, 3)) != 1)
+    {
+        printf("Batch with a long name created %d, failed test...\n", return_value);
+        return -1;
+    }
+    if((return_value = file_create_batch("/d", exists_batch, 3)) != 1)
+    {
+        printf("Batch with an existing name created %d, failed test...\n", return_value);
+        return -1;
+    }
+    if(file_create_batch("/nope", dup_batch, 1) != ERR_FILE_NOT_FOUND)
+    {
+        printf("Batch in a missing dir did not fail, failed test...\n");
+        return -1;
+    }
+
+    for(i = 0; i < num_files; i++)
+    {
+        batch[i] = malloc(12);
+        sprintf(batch[i], "n%d", i);
+    }
+    if((return_value = file_create_batch("/d", batch, num_files)) != num_files)
+    {
+        printf("Batch of %d created %d, failed test...\n", num_files, return_value);
+        return -1;
+    }
+
+    printf("Reopening...\n");
+    if(close_fs() != SUCCESS || open_fs("test_disk.dat") != SUCCESS)
+    {
+        printf("Could not reopen disk, failed test...\n");
+        return -1;
+    }
+
+    //a, c0 to c3 and the batch
+    list = file_listdir("/d");
+    for(entries = 0; list != NULL && strcmp(list[entries], "") != 0; entries++)
+        ;
+    if(entries != num_files + 5)
+    {
+        printf("Listed %d entries in /d, failed test...\n", entries);
+        return -1;
+    }
+
+    for(i = 0; i < num_files; i++)
+    {
+        sprintf(name, "/d/%s", batch[i]);
+        if((file_number = file_open(name)) < 0 || file_close(file_number) != SUCCESS)
+        {
+            printf("Could not open %s, failed test...\n", name);
+            return -1;
+        }
+        if(file_delete(name) != SUCCESS)
+        {
+            printf("Error deleting %s...\n", name);
+            return -1;
+        }
+        free(batch[i]);
+    }
+
+    for(i = 0; i < 4; i++)
+    {
+        sprintf(name, "/d/c%d", i);
+        file_delete(name);
+    }
+
+    if(file_delete("/d/a") != SUCCESS || file_rmdir("/d") != SUCCESS)
+    {
+        printf("Error removing dir...\n");
+        return -1;
+    }
+
+    close_fs();
+    unlink("test_disk.dat");
+
+    return 0;
+}
+
+void test_dirs()
+{
+    int flags[] = {0, FORMAT_DIR_INDEX};
+    int f;
+
+    for(f = 0; f < sizeof(flags) / sizeof(flags[0]); f++)
+    {
+        if(test_readdir(flags[f]) || test_at(flags[f]) || test_create_batch(flags[f]))
+            return;
+    }
+
+    printf("Passed directory tests...\n");
+}
+
+// file_writev and file_readv with pieces crossing block boundaries at different places on
+// the way out and on the way back.
+void test_vectored()
+{
+    struct iovec iov[3];
+    unsigned char data[1705], restored[1705];
+    int file_number, i;
+
+    printf("Doing readv/writev test...\n");
+
+    if(format_fs("test_disk.dat", 8192) != SUCCESS || open_fs("test_disk.dat") != SUCCESS)
+    {
+        printf("Could not format and open disk, failed test...\n");
+        return;
+    }
+
+    for(i = 0; i < sizeof(data); i++)
+    {
+        data[i] = i * 13 + 1;
+    }
+
+    file_create("/v");
+    file_number = file_open("/v");
+
+    iov[0].iov_base = data;
+    iov[0].iov_len = 5;
+    iov[1].iov_base = data + 5;
+    iov[1].iov_len = 1000;
+    iov[2].iov_base = data + 1005;
+    iov[2].iov_len = 700;
+    if(file_writev(file_number, iov, 3) != sizeof(data))
+    {
+        printf("Error while writing...\n");
+        return;
+    }
+
+    file_lseek(file_number, 0, LSEEK_ABSOLUTE);
+    memset(restored, 0, sizeof(restored));
+    iov[0].iov_base = restored;
+    iov[0].iov_len = 300;
+    iov[1].iov_base = restored + 300;
+    iov[1].iov_len = 1;
+    iov[2].iov_base = restored + 301;
+    iov[2].iov_len = 1404;
+    if(file_readv(file_number, iov, 3) != sizeof(data) || memcmp(data, restored, sizeof(data)) != 0)
+    {
+        printf("Error during compare...\n");
+        return;
+    }
+    file_close(file_number);
+
+    if(file_delete("/v") != SUCCESS)
+    {
+        printf("Error deleting file...\n");
+        return;
+    }
+
+    close_fs();
+    unlink("test_disk.dat");
+
+    printf("Passed readv/writev test...\n");
 }